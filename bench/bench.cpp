@@ -0,0 +1,428 @@
+// pe-parser-bench: micro-benchmarks of every parse and serialize stage on
+// synthetic PE files, and a corpus mode to measure throughput on real files.
+//
+// Usage:
+//   pe-parser-bench [--filter <substring>] [--min-time <seconds>]
+//                   [--sections <n>] [--section-size <bytes>]
+//                   [--resources <n>] [--resource-size <bytes>] [--pe32+]
+//   pe-parser-bench --corpus <directory> [--ingest [--queue-depth <n>]]
+//   pe-parser-bench --verify
+//
+// With --ingest, the corpus is read with ingest_pe_files instead of one file
+// at a time with read_pe_file.
+//
+// With --verify, nothing is timed. Instead, the SIMD code of the checksum and
+// of the UTF-16/UTF-8 transcoding is compared with the portable code on random
+// input of many lengths and alignments, and the exit code tells whether they
+// agreed.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "pe-cache.hpp"
+#include "pe-checksum.hpp"
+#include "pe-digest.hpp"
+#include "pe-ingest.hpp"
+#include "pe-probe.hpp"
+#include "pe-res.hpp"
+#include "pe-stream.hpp"
+#include "pe-strings.hpp"
+#include "pe-utf.hpp"
+#include "pe.hpp"
+#include "synthetic.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the compiler from optimizing away the results of benchmarked code.
+size_t volatile sink;
+
+struct Benchmark {
+	char const * name;
+	size_t bytes; // Processed per iteration, for the throughput.
+	std::function<void ()> run;
+};
+
+void run_benchmark(Benchmark const & b, double min_time) {
+	size_t iterations = 1;
+	double elapsed;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i) b.run();
+		elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		if (elapsed >= min_time || iterations >= (size_t(1) << 30)) break;
+		// Aim a bit over min_time, but never grow more than 10x at once.
+		double factor = elapsed > 0 ? min_time * 1.4 / elapsed : 10;
+		iterations = iterations * std::min(std::max(factor, 2.0), 10.0);
+	}
+	double ns = elapsed * 1e9 / iterations;
+	double mb_per_s = b.bytes * double(iterations) / elapsed / 1e6;
+	std::printf("%-28s %14.0f ns %12zu %12.1f MB/s\n", b.name, ns, iterations, mb_per_s);
+}
+
+PE::Section const & find_section(PE::PortableExecutable const & pe, char const * name) {
+	for (auto const & s : pe.sections) if (s.name == name) return s;
+	throw std::runtime_error(std::string("No ") + name + " section.");
+}
+
+int run_benchmarks(PE::bench::SyntheticOptions const & options, char const * filter, double min_time) {
+	auto pe = PE::bench::make_synthetic_pe(options);
+
+	std::vector<unsigned char> image(PE::pe_image_size(pe));
+	PE::write_pe_image(image, pe);
+
+	auto const & rsrc = find_section(pe, ".rsrc");
+	auto resources = PE::parse_resources(rsrc.data, rsrc.virtual_address);
+	auto version_data = PE::find_resource(rsrc.data, rsrc.virtual_address, 16);
+	auto version_info = PE::parse_version_info(version_data);
+	PE::ResourceLayout layout(resources);
+	std::vector<unsigned char> rsrc_buffer(layout.size());
+	PE::VersionInfoTree version_tree;
+	PE::VersionInfoTree parsed_version_tree(version_data);
+	PE::VersionStrings version_strings;
+	auto image_view = PE::read_pe_image(image);
+	std::vector<unsigned char> not_pe(image.begin(), image.begin() + 0x200);
+	not_pe[0] = 'Z';
+	auto cache_entry = PE::make_cache_entry(PE::CacheKey(), image_view);
+
+	// A string table of 4096 strings in 256 bundles, on its own.
+	std::map<uint16_t, std::u16string> strings;
+	for (uint16_t id = 0; id < 4096; ++id) strings[id] = u"String " + PE::from_number(id);
+	auto string_bundles = PE::serialize_string_table(strings);
+	std::map<PE::ResourceId, mstd::range<unsigned char const>> string_resources;
+	PE::set_string_table(string_resources, string_bundles, 1033);
+	auto string_section = PE::serialize_resources(string_resources, 0);
+	PE::ResourceTable string_resource_table(string_section, 0);
+	PE::StringTable string_table(string_resource_table);
+	uint16_t string_id = 0;
+
+	FILE * file = std::tmpfile();
+	if (!file) throw std::runtime_error("Unable to create temporary file.");
+	PE::write_pe_file(file, pe);
+
+	std::vector<Benchmark> benchmarks = {
+		{"read_pe_file", image.size(), [&] {
+			std::rewind(file);
+			sink = PE::read_pe_file(file).sections.size();
+		}},
+		{"read_pe_image", image.size(), [&] {
+			sink = PE::read_pe_image(image).sections.size();
+		}},
+		{"probe", image.size(), [&] {
+			sink = PE::probe(image).n_sections;
+		}},
+		{"read_pe_image (invalid)", 0, [&] {
+			try {
+				sink = PE::read_pe_image(not_pe).sections.size();
+			} catch (std::exception const &) {
+				sink = 0;
+			}
+		}},
+		{"try_read_pe_image (invalid)", 0, [&] {
+			auto result = PE::try_read_pe_image(not_pe);
+			sink = result ? result->sections.size() : result.error().reason;
+		}},
+		{"read_pe_stream", image.size(), [&] {
+			size_t offset = 0;
+			PE::read_pe_stream([&] (unsigned char * buffer, size_t size) {
+				size = std::min(size, image.size() - offset);
+				std::memcpy(buffer, image.data() + offset, size);
+				offset += size;
+				return size;
+			}, [] (PE::StreamReader const &) {}, [] (size_t, mstd::range<unsigned char const> data) {
+				sink = data.size();
+			});
+		}},
+		{"write_pe_file", image.size(), [&] {
+			std::rewind(file);
+			PE::write_pe_file(file, pe);
+		}},
+		{"write_pe_image", image.size(), [&] {
+			PE::write_pe_image(image, pe);
+		}},
+		{"compute_checksum", image.size(), [&] {
+			sink = PE::compute_checksum(image);
+		}},
+		{"image_digest", image.size(), [&] {
+			sink = PE::image_digest(image)[0];
+		}},
+		{"parse_resources", rsrc.data.size(), [&] {
+			sink = PE::parse_resources(rsrc.data, rsrc.virtual_address).size();
+		}},
+		{"ResourceTable", rsrc.data.size(), [&] {
+			sink = PE::ResourceTable(rsrc.data, rsrc.virtual_address).size();
+		}},
+		{"find_resource", rsrc.data.size(), [&] {
+			sink = PE::find_resource(rsrc.data, rsrc.virtual_address, 16).size();
+		}},
+		{"serialize_resources", rsrc.data.size(), [&] {
+			sink = PE::serialize_resources(resources, rsrc.virtual_address).size();
+		}},
+		{"ResourceLayout::serialize", rsrc.data.size(), [&] {
+			PE::ResourceLayout(resources).serialize(rsrc_buffer, rsrc.virtual_address);
+		}},
+		{"parse_version_info", version_data.size(), [&] {
+			sink = PE::parse_version_info(version_data).file_version;
+		}},
+		{"VersionInfoTree::parse", version_data.size(), [&] {
+			version_tree.parse(version_data);
+			sink = version_tree.nodes().size();
+		}},
+		{"VersionStrings::assign", version_data.size(), [&] {
+			version_strings.assign(parsed_version_tree);
+			sink = version_strings.entries().size();
+		}},
+		{"serialize_version_info", version_data.size(), [&] {
+			sink = PE::serialize_version_info(version_info).size();
+		}},
+		{"StringTable", string_section.size(), [&] {
+			sink = PE::StringTable(string_resource_table).n_bundles();
+		}},
+		{"StringTable::find", 0, [&] {
+			sink = string_table.find(string_id++ % 4096).size();
+		}},
+		{"make_cache_entry", rsrc.data.size(), [&] {
+			sink = PE::make_cache_entry(PE::CacheKey(), image_view).size();
+		}},
+		{"CacheEntry::version_info", version_data.size(), [&] {
+			sink = PE::CacheEntry(cache_entry).version_info().file_version;
+		}},
+	};
+
+	std::printf("%zu sections of %zu bytes, %zu resources of %zu bytes, %zu byte image\n\n",
+		options.n_sections, options.section_size, options.n_resources, options.resource_size, image.size());
+	std::printf("%-28s %17s %12s %17s\n", "Benchmark", "Time", "Iterations", "Throughput");
+	for (auto const & b : benchmarks) {
+		if (filter && !std::strstr(b.name, filter)) continue;
+		run_benchmark(b, min_time);
+	}
+
+	std::fclose(file);
+	return 0;
+}
+
+struct CorpusStats {
+	size_t n_files = 0;
+	size_t n_pe_files = 0;
+	size_t n_version_infos = 0;
+	size_t n_bytes = 0;
+};
+
+// Parse the resources and the version information of a file, like a typical
+// consumer would.
+void process_pe(PE::PortableExecutable const & pe, CorpusStats & stats) {
+	++stats.n_pe_files;
+	for (auto const & s : pe.sections) stats.n_bytes += s.data.size();
+	stats.n_bytes += pe.headers.size();
+	for (auto const & s : pe.sections) {
+		if (s.name != ".rsrc") continue;
+		try {
+			auto resources = PE::parse_resources(s.data, s.virtual_address);
+			for (auto const & r : resources) {
+				if (r.first.type != u"16") continue;
+				sink = PE::parse_version_info(r.second).file_version;
+				++stats.n_version_infos;
+			}
+		} catch (std::runtime_error const &) {
+		}
+	}
+}
+
+void process_file(char const * file_name, CorpusStats & stats) {
+	++stats.n_files;
+	PE::PortableExecutable pe;
+	try {
+		pe = PE::read_pe_file(file_name);
+	} catch (std::runtime_error const &) {
+		return;
+	}
+	process_pe(pe, stats);
+}
+
+#ifndef WIN32
+void list_directory(std::string const & directory, std::vector<std::string> & files) {
+	DIR * d = opendir(directory.c_str());
+	if (!d) return;
+	while (dirent * e = readdir(d)) {
+		if (!std::strcmp(e->d_name, ".") || !std::strcmp(e->d_name, "..")) continue;
+		std::string path = directory + "/" + e->d_name;
+		struct stat s;
+		if (stat(path.c_str(), &s) != 0) continue;
+		if (S_ISDIR(s.st_mode)) {
+			list_directory(path, files);
+		} else if (S_ISREG(s.st_mode)) {
+			files.push_back(std::move(path));
+		}
+	}
+	closedir(d);
+}
+#endif
+
+int run_corpus(char const * directory, bool ingest, unsigned queue_depth) {
+#ifdef WIN32
+	(void)directory;
+	(void)ingest;
+	(void)queue_depth;
+	std::fprintf(stderr, "Corpus mode is not supported on this platform.\n");
+	return 1;
+#else
+	CorpusStats stats;
+	auto start = Clock::now();
+	std::vector<std::string> files;
+	list_directory(directory, files);
+	if (ingest) {
+		PE::IngestOptions options;
+		options.queue_depth = queue_depth;
+		std::mutex mutex;
+		PE::ingest_pe_files(files, [&] (PE::IngestResult & result) {
+			CorpusStats s;
+			s.n_files = 1;
+			if (result.ok) process_pe(result.pe, s);
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.n_files         += s.n_files;
+			stats.n_pe_files      += s.n_pe_files;
+			stats.n_version_infos += s.n_version_infos;
+			stats.n_bytes         += s.n_bytes;
+		}, options);
+	} else {
+		for (auto const & f : files) process_file(f.c_str(), stats);
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	std::printf("%zu files, %zu PE files, %zu version infos, %zu bytes in %.3f s\n",
+		stats.n_files, stats.n_pe_files, stats.n_version_infos, stats.n_bytes, elapsed);
+	std::printf("%.1f files/s, %.1f MB/s\n", stats.n_files / elapsed, stats.n_bytes / elapsed / 1e6);
+	return 0;
+#endif
+}
+
+// Random bytes, with long runs of 0xFF (the largest sums) or zeros.
+void fill_random(std::mt19937 & rng, mstd::range<unsigned char> data) {
+	int mode = rng() % 4;
+	for (auto & b : data) {
+		if (mode == 1) b = 0xFF;
+		else if (mode == 2) b = rng() % 16 ? 0 : rng();
+		else b = rng();
+	}
+}
+
+// Returns the number of differences.
+size_t verify_checksum(std::mt19937 & rng, mstd::range<unsigned char const> data) {
+	size_t failures = 0;
+	if (char const * kernel = PE::check_checksum_kernels(data)) {
+		std::printf("checksum: %s differs on %zu bytes\n", kernel, data.size());
+		++failures;
+	}
+	// In pieces of random (often odd) sizes.
+	PE::Checksum whole, pieces;
+	whole.update(data);
+	for (size_t i = 0; i < data.size();) {
+		size_t n = std::min<size_t>(data.size() - i, rng() % 100);
+		pieces.update(data.subrange(i, n));
+		i += n;
+	}
+	if (whole.value() != pieces.value()) {
+		std::printf("checksum: differs in pieces on %zu bytes\n", data.size());
+		++failures;
+	}
+	return failures;
+}
+
+// Mostly ASCII, so the kernels get far, with other characters (or bytes)
+// at random places to stop them.
+size_t verify_utf(std::mt19937 & rng, mstd::range<unsigned char> data) {
+	size_t rate = 1 + rng() % 200;
+	for (size_t i = 0; i + 1 < data.size(); i += 2) {
+		uint16_t c = 0x20 + rng() % 0x5F;
+		if (rng() % rate == 0) {
+			switch (rng() % 4) {
+				case 0: c = 0x80 + rng() % 0x80; break; // Only the low byte isn't ASCII.
+				case 1: c = c | (1 + rng() % 0xFF) << 8; break; // Only the high byte isn't zero.
+				case 2: c = 0xD800 + rng() % 0x800; break; // Surrogates.
+				default: c = rng(); break;
+			}
+		}
+		data[i] = c;
+		data[i + 1] = c >> 8;
+	}
+	std::string utf8(data.size(), 0);
+	for (auto & c : utf8) c = rng() % rate == 0 ? char(0x80 + rng() % 0x80) : char(0x20 + rng() % 0x5F);
+
+	if (char const * kernel = PE::check_utf_kernels(data, mstd::range<char const>(utf8.data(), utf8.size()))) {
+		std::printf("utf: %s differs on %zu bytes\n", kernel, data.size());
+		return 1;
+	}
+	return 0;
+}
+
+int run_verify() {
+	std::mt19937 rng(1);
+	// Room for a few lanes of the checksum kernels to need widening.
+	std::vector<unsigned char> buffer((size_t(1) << 20) + 64);
+	size_t failures = 0;
+	size_t n = 20000;
+	for (size_t i = 0; i < n; ++i) {
+		// Every small size, then random sizes, and a few large ones. Starting
+		// at a random offset, to test unaligned loads as well.
+		size_t size = i < 1024 ? i : rng() % (i < n - 20 ? 4096 : buffer.size() - 64);
+		mstd::range<unsigned char> data(buffer.data() + rng() % 64, size);
+		fill_random(rng, data);
+		failures += verify_checksum(rng, data);
+		failures += verify_utf(rng, data);
+	}
+	std::printf("%zu inputs, %zu differences\n", n, failures);
+	return failures ? 1 : 0;
+}
+
+}
+
+int main(int argc, char ** argv) try {
+	PE::bench::SyntheticOptions options;
+	char const * filter = nullptr;
+	char const * corpus = nullptr;
+	bool ingest = false;
+	bool verify = false;
+	unsigned queue_depth = 64;
+	double min_time = 0.5;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&] {
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg + ".");
+			return argv[++i];
+		};
+		if (arg == "--filter") filter = value();
+		else if (arg == "--min-time") min_time = std::atof(value());
+		else if (arg == "--sections") options.n_sections = std::strtoull(value(), nullptr, 10);
+		else if (arg == "--section-size") options.section_size = std::strtoull(value(), nullptr, 10);
+		else if (arg == "--resources") options.n_resources = std::strtoull(value(), nullptr, 10);
+		else if (arg == "--resource-size") options.resource_size = std::strtoull(value(), nullptr, 10);
+		else if (arg == "--pe32+") options.pe32_plus = true;
+		else if (arg == "--corpus") corpus = value();
+		else if (arg == "--ingest") ingest = true;
+		else if (arg == "--queue-depth") queue_depth = std::strtoul(value(), nullptr, 10);
+		else if (arg == "--verify") verify = true;
+		else throw std::runtime_error("Unknown argument: " + arg);
+	}
+
+	if (verify) return run_verify();
+	if (corpus) return run_corpus(corpus, ingest, queue_depth);
+	return run_benchmarks(options, filter, min_time);
+} catch (std::exception const & e) {
+	std::fprintf(stderr, "%s\n", e.what());
+	return 1;
+}
@@ -0,0 +1,127 @@
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pe-bytes.hpp"
+#include "pe-res.hpp"
+#include "synthetic.hpp"
+
+namespace PE {
+namespace bench {
+
+namespace {
+
+// xorshift32, so the output doesn't depend on the standard library.
+struct Random {
+	uint32_t state;
+	uint32_t operator () () {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+};
+
+std::vector<unsigned char> random_bytes(Random & random, size_t size) {
+	std::vector<unsigned char> data(size);
+	for (auto & c : data) c = random();
+	return data;
+}
+
+uint32_t align(uint32_t value, uint32_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+}
+
+PortableExecutable make_synthetic_pe(SyntheticOptions const & options) {
+	Random random{options.seed ? options.seed : 1};
+
+	uint32_t const pe_header_offset = 0x80;
+	uint32_t const optheader_size = options.pe32_plus ? 0xF0 : 0xE0;
+	uint32_t const section_alignment = 0x1000;
+	uint32_t const data_directories = pe_header_offset + 0x18 + (options.pe32_plus ? 0x70 : 0x60);
+
+	PortableExecutable pe;
+
+	auto & h = pe.headers;
+	h.resize(pe_header_offset + 0x18 + optheader_size);
+	h[0] = 'M';
+	h[1] = 'Z';
+	write_uint32(&h[0x3C], pe_header_offset);
+	write_uint32(&h[pe_header_offset], 0x00004550);
+	write_uint16(&h[pe_header_offset + 0x04], options.pe32_plus ? 0x8664 : 0x14C); // Machine
+	write_uint16(&h[pe_header_offset + 0x06], options.n_sections + 1);
+	write_uint16(&h[pe_header_offset + 0x14], optheader_size);
+	write_uint16(&h[pe_header_offset + 0x16], 0x0102); // Characteristics
+	write_uint16(&h[pe_header_offset + 0x18], options.pe32_plus ? 0x20B : 0x10B);
+	write_uint32(&h[pe_header_offset + 0x38], section_alignment);
+	write_uint32(&h[pe_header_offset + 0x3C], 0x200); // FileAlignment
+	write_uint32(&h[data_directories - 4], 16); // NumberOfRvaAndSizes
+
+	uint32_t virtual_address = section_alignment;
+
+	for (size_t i = 0; i < options.n_sections; ++i) {
+		Section section;
+		section.name = i == 0 ? ".text" : ".data" + std::to_string(i);
+		section.virtual_address = virtual_address;
+		section.virtual_size = options.section_size;
+		section.characteristics = i == 0 ? 0x60000020 : 0xC0000040;
+		section.data = random_bytes(random, options.section_size);
+		pe.sections.push_back(std::move(section));
+		virtual_address += align(options.section_size ? options.section_size : 1, section_alignment);
+	}
+
+	VersionInfo info = {};
+	info.signature = 0xFEEF04BD;
+	info.struc_version = 0x10000;
+	info.file_version = info.product_version = 0x0001000200030004;
+	info.file_os = 0x40004;
+	info.file_type = 1;
+	info.string_file_info = std::make_unique<StringFileInfo>();
+	info.string_file_info->blocks.emplace_back(u"040904b0", std::vector<std::pair<std::u16string, std::u16string>>{
+		{u"CompanyName", u"Synthetic"},
+		{u"FileDescription", u"Synthetic benchmark executable"},
+		{u"FileVersion", u"1.2.3.4"},
+		{u"ProductName", u"pe-parser-bench"},
+		{u"ProductVersion", u"1.2.3.4"},
+	});
+	info.var_file_info = std::make_unique<VarFileInfo>();
+	info.var_file_info->values.emplace_back(u"Translation", std::vector<unsigned char>{0x09, 0x04, 0xB0, 0x04});
+
+	std::vector<std::vector<unsigned char>> resource_data;
+	resource_data.reserve(options.n_resources + 1);
+	resource_data.push_back(serialize_version_info(info));
+
+	std::map<ResourceId, mstd::range<unsigned char const>> resources;
+	resources.emplace(ResourceId(u"16", u"1", u"1033"), resource_data.back());
+
+	// A mix of numeric icons, string tables, and named resources of a named type.
+	for (size_t i = 0; i < options.n_resources; ++i) {
+		resource_data.push_back(random_bytes(random, options.resource_size));
+		ResourceId id;
+		switch (i % 3) {
+			case 0: id = ResourceId(u"3", from_number(i + 1), u"1033"); break;
+			case 1: id = ResourceId(u"6", from_number(i + 1), u"1033"); break;
+			default: id = ResourceId(u"DATA", u"ITEM" + from_number(i), u"0"); break;
+		}
+		resources.emplace(std::move(id), resource_data.back());
+	}
+
+	Section rsrc;
+	rsrc.name = ".rsrc";
+	rsrc.virtual_address = virtual_address;
+	rsrc.characteristics = 0x40000040;
+	auto rsrc_data = serialize_resources(resources, virtual_address);
+	rsrc.virtual_size = rsrc_data.size();
+	rsrc.data = std::move(rsrc_data);
+	write_uint32(&h[data_directories + 2 * 8], virtual_address);
+	write_uint32(&h[data_directories + 2 * 8 + 4], rsrc.virtual_size);
+	pe.sections.push_back(std::move(rsrc));
+
+	return pe;
+}
+
+}
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pe.hpp"
+
+namespace PE {
+namespace bench {
+
+struct SyntheticOptions {
+	size_t n_sections = 4; // Besides .rsrc.
+	size_t section_size = 64 * 1024;
+	size_t n_resources = 100; // Besides the version information.
+	size_t resource_size = 1024;
+	bool pe32_plus = false;
+	uint32_t seed = 1;
+};
+
+// Generate a PE file with the given number and sizes of sections and
+// resources, and a version information resource. The same options always
+// give the same file.
+PortableExecutable make_synthetic_pe(SyntheticOptions const &);
+
+}
+}
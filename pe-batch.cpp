@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "pe-batch.hpp"
+#include "pe-budget.hpp"
+#include "pe-map.hpp"
+
+namespace PE {
+
+size_t stamp_version_info(PortableExecutable & pe, std::function<void (VersionInfo &)> const & transform) {
+	auto rsrc = std::find_if(pe.sections.begin(), pe.sections.end(), [] (Section const & s) {
+		return s.name == ".rsrc";
+	});
+	if (rsrc == pe.sections.end()) return 0;
+
+	auto resources = parse_resources(rsrc->data, rsrc->virtual_address);
+
+	// Moving the inner vectors when this grows doesn't move their data.
+	std::vector<std::vector<unsigned char>> new_data;
+
+	for (auto & r : resources) {
+		if (r.first.type != u"16") continue;
+		VersionInfo info = parse_version_info(r.second);
+		transform(info);
+		new_data.push_back(serialize_version_info(info));
+		r.second = new_data.back();
+	}
+
+	if (new_data.empty()) return 0;
+
+	auto data = serialize_resources(resources, rsrc->virtual_address);
+
+	size_t end = size_t(rsrc->virtual_address) + data.size();
+	for (auto const & s : pe.sections) {
+		if (&s != &*rsrc && s.virtual_address >= rsrc->virtual_address && s.virtual_address < end) {
+			throw std::runtime_error("Resource section doesn't fit before the next section.");
+		}
+	}
+
+	rsrc->virtual_size = data.size();
+	rsrc->data = std::move(data);
+
+	return new_data.size();
+}
+
+namespace {
+
+// The jobs assigned to one worker. Other workers steal from the back when
+// they run out of their own jobs.
+struct WorkQueue {
+	std::mutex mutex;
+	std::deque<size_t> jobs;
+};
+
+bool take_job(std::vector<WorkQueue> & queues, size_t self, size_t & job) {
+	{
+		auto & q = queues[self];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (!q.jobs.empty()) {
+			job = q.jobs.front();
+			q.jobs.pop_front();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < queues.size(); ++i) {
+		auto & q = queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (!q.jobs.empty()) {
+			job = q.jobs.back();
+			q.jobs.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t file_size(char const * file_name) {
+	struct stat s;
+	if (stat(file_name, &s) != 0) return 0;
+	return s.st_size;
+}
+
+#ifndef WIN32
+// Write pe to a new file in the same directory as output, and rename it over
+// output. The new file gets the permissions of the file it replaces (or of
+// input, if there is none), and its owner and group where that's allowed.
+//
+// If output is a symbolic link, the file it points to is replaced, and the
+// link is kept. Other hard links to that file keep the old contents, and
+// ACLs and extended attributes aren't copied.
+void replace_file(std::string const & output, std::string const & input, PortableExecutable const & pe) {
+	std::string target = output;
+	if (char * resolved = realpath(output.c_str(), nullptr)) {
+		target = resolved;
+		std::free(resolved);
+	}
+
+	struct stat s;
+	bool replaces = stat(target.c_str(), &s) == 0;
+	if (!replaces && stat(input.c_str(), &s) != 0) throw std::runtime_error("Unable to open file.");
+
+	std::string temp = target + ".XXXXXX";
+	int fd = mkstemp(&temp[0]);
+	if (fd < 0) throw std::runtime_error("Unable to open file.");
+	try {
+		write_pe_file(temp.c_str(), pe);
+		// Only after writing, since the mode might not allow writing.
+		if (fchmod(fd, s.st_mode & 07777) != 0) throw std::runtime_error("Unable to write to file.");
+		if (replaces && fchown(fd, s.st_uid, s.st_gid) != 0) {
+			// Only allowed for root, or for a group we're in. The file
+			// stays ours.
+		}
+	} catch (...) {
+		close(fd);
+		std::remove(temp.c_str());
+		throw;
+	}
+	close(fd);
+	if (std::rename(temp.c_str(), target.c_str()) != 0) {
+		std::remove(temp.c_str());
+		throw std::runtime_error("Unable to rename file.");
+	}
+}
+#endif
+
+BatchResult run_job(BatchJob const & job) {
+	BatchResult result;
+	try {
+		std::string const & output = job.output_file_name.empty() ? job.file_name : job.output_file_name;
+#ifdef WIN32
+		auto pe = read_pe_file(job.file_name.c_str());
+		result.n_version_infos = stamp_version_info(pe, job.transform);
+		if (result.n_version_infos > 0 || output != job.file_name) {
+			write_pe_file(output.c_str(), pe);
+		}
+#else
+		// The sections stay views into the input file, so the output is
+		// written to a temporary file first, even if it replaces the input.
+		auto pe = map_pe_file(job.file_name.c_str());
+		result.n_version_infos = stamp_version_info(pe, job.transform);
+		if (result.n_version_infos > 0 || output != job.file_name) {
+			replace_file(output, job.file_name, pe);
+		}
+#endif
+		result.ok = true;
+	} catch (std::exception const & e) {
+		result.error = e.what();
+	} catch (...) {
+		result.error = "Unknown error.";
+	}
+	return result;
+}
+
+}
+
+std::vector<BatchResult> run_batch(std::vector<BatchJob> const & jobs, BatchOptions const & options) {
+	std::vector<BatchResult> results(jobs.size());
+	if (jobs.empty()) return results;
+
+	size_t n_threads = options.n_threads;
+	if (n_threads == 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+	n_threads = std::min(n_threads, jobs.size());
+
+	std::vector<WorkQueue> queues(n_threads);
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		queues[i % n_threads].jobs.push_back(i);
+	}
+
+	ByteBudget budget(options.max_bytes_in_flight);
+
+	auto worker = [&] (size_t self) {
+		size_t i;
+		while (take_job(queues, self, i)) {
+			size_t size = file_size(jobs[i].file_name.c_str());
+			budget.acquire(size);
+			results[i] = run_job(jobs[i]);
+			budget.release(size);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(n_threads - 1);
+	for (size_t i = 1; i < n_threads; ++i) threads.emplace_back(worker, i);
+	worker(0);
+	for (auto & t : threads) t.join();
+
+	return results;
+}
+
+}
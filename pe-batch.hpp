@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "pe-res.hpp"
+#include "pe.hpp"
+
+namespace PE {
+
+// Apply transform to every version information resource (type 16) in the
+// .rsrc section of pe, and re-serialize the section.
+//
+// Returns the number of version information resources that were found.
+// Throws if the re-serialized section no longer fits before the next section.
+size_t stamp_version_info(PortableExecutable & pe, std::function<void (VersionInfo &)> const & transform);
+
+struct BatchJob {
+	std::string file_name;
+	std::string output_file_name; // Empty to overwrite file_name.
+	std::function<void (VersionInfo &)> transform;
+};
+
+struct BatchResult {
+	bool ok = false;
+	std::string error; // Only set if !ok.
+	size_t n_version_infos = 0; // See stamp_version_info.
+};
+
+struct BatchOptions {
+	// The number of threads. Zero means one per core.
+	unsigned n_threads = 0;
+
+	// The maximum total size of the files being processed at the same time.
+	// A file larger than this is processed alone.
+	size_t max_bytes_in_flight = size_t(1) << 30;
+};
+
+// Run stamp_version_info on many files in parallel.
+//
+// A failing job doesn't stop the others: every job gets its own result, in
+// the same order as the jobs. Output files are written to a temporary file
+// in the same directory first, and renamed when complete. The new file keeps
+// the permissions (and, where allowed, the owner) of the file it replaces,
+// and a symbolic link is kept, with the file it points to replaced. Hard
+// links to the old file, ACLs and extended attributes aren't kept.
+std::vector<BatchResult> run_batch(std::vector<BatchJob> const & jobs, BatchOptions const & options = BatchOptions());
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// Internal helper shared by run_batch and ingest_pe_files. Not part of the
+// public interface.
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+namespace PE {
+
+// Limits the total size of the files being processed at once.
+//
+// Something larger than the maximum is only allowed when nothing else is in
+// flight, so it's processed alone instead of never.
+class ByteBudget {
+public:
+	explicit ByteBudget(size_t max) : max_(max) {}
+
+	void acquire(size_t n) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [&] { return fits(n); });
+		in_flight_ += n;
+	}
+
+	// Like acquire, but returns false instead of waiting.
+	bool try_acquire(size_t n) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!fits(n)) return false;
+		in_flight_ += n;
+		return true;
+	}
+
+	void release(size_t n) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			in_flight_ -= n;
+		}
+		cv_.notify_all();
+	}
+
+	// Wait until n bytes would fit.
+	void wait(size_t n) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [&] { return fits(n); });
+	}
+
+private:
+	bool fits(size_t n) const {
+		return in_flight_ == 0 || in_flight_ + n <= max_;
+	}
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	size_t max_;
+	size_t in_flight_ = 0;
+};
+
+}
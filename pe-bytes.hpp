@@ -0,0 +1,62 @@
+#pragma once
+
+// Internal helpers for reading and writing little-endian fields, shared by the
+// parsers and serializers. Not part of the public interface.
+
+#include <cstddef>
+#include <cstdint>
+
+#include <mstd/range.hpp>
+
+#include "pe-layout.hpp"
+
+namespace PE {
+
+// Takes n_bytes from the front of data, or throws error if there aren't enough.
+inline mstd::range<unsigned char const> read_data(mstd::range<unsigned char const> & data, size_t n_bytes, int error) {
+	if (data.size() < n_bytes) throw error;
+	auto d = data.subrange(0, n_bytes);
+	data.remove_prefix(n_bytes);
+	return d;
+}
+
+inline uint32_t read_uint32(mstd::range<unsigned char const> & data, int error) {
+	return load_le<uint32_t>(read_data(data, 4, error).data());
+}
+
+inline uint32_t read_uint16(mstd::range<unsigned char const> & data, int error) {
+	return load_le<uint16_t>(read_data(data, 2, error).data());
+}
+
+// Like read_data, read_uint32 and read_uint16, but returning false instead of
+// throwing, without taking anything from data.
+inline bool take_data(mstd::range<unsigned char const> & data, size_t n_bytes, mstd::range<unsigned char const> & out) {
+	if (data.size() < n_bytes) return false;
+	out = data.subrange(0, n_bytes);
+	data.remove_prefix(n_bytes);
+	return true;
+}
+
+inline bool take_uint32(mstd::range<unsigned char const> & data, uint32_t & value) {
+	if (data.size() < 4) return false;
+	value = load_le<uint32_t>(data.data());
+	data.remove_prefix(4);
+	return true;
+}
+
+inline bool take_uint16(mstd::range<unsigned char const> & data, uint16_t & value) {
+	if (data.size() < 2) return false;
+	value = load_le<uint16_t>(data.data());
+	data.remove_prefix(2);
+	return true;
+}
+
+inline void write_uint16(unsigned char * data, uint16_t value) {
+	store_le<uint16_t>(data, value);
+}
+
+inline void write_uint32(unsigned char * data, uint32_t value) {
+	store_le<uint32_t>(data, value);
+}
+
+}
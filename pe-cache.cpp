@@ -0,0 +1,492 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifndef WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "pe-bytes.hpp"
+#include "pe-cache.hpp"
+#include "pe-layout.hpp"
+
+namespace PE {
+
+namespace {
+
+// Layout of a cache entry:
+//
+//   0x00  "PERC"
+//   0x04  format version
+//   0x08  key (32 bytes)
+//   0x28  size of the entry
+//   0x2C  number of resources
+//   0x30  number of version information nodes
+//   0x34  size of the strings
+//   0x38  index of the StringFileInfo node, or none
+//   0x3C  index of the VarFileInfo node, or none
+//   0x40  fixed version information, in the order of VS_FIXEDFILEINFO
+//   0x74  resources: type, name, lang, data RVA, data size
+//         version information nodes: name offset, name size, value offset,
+//         value size, is string, first child, next sibling
+//         strings
+//
+// Names of resources are stored as in the resource section (length, followed
+// by the characters), and the name keys of the resources refer to those.
+// Offsets of names and values are relative to the start of the strings.
+
+unsigned char const magic[4] = {'P', 'E', 'R', 'C'};
+uint32_t const format_version = 1;
+size_t const fixed_offset = 0x40;
+size_t const header_size = fixed_offset + layout::FixedFileInfo::size;
+size_t const resource_size = 20;
+size_t const node_size = 28;
+
+uint32_t uint32_at(mstd::range<unsigned char const> data, size_t offset) {
+	auto p = data.data() + offset;
+	return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+void append_uint32(std::vector<unsigned char> & out, uint32_t value) {
+	out.resize(out.size() + 4);
+	write_uint32(&out[out.size() - 4], value);
+}
+
+uint32_t append_bytes(std::vector<unsigned char> & out, mstd::range<unsigned char const> data) {
+	uint32_t offset = out.size();
+	out.insert(out.end(), data.begin(), data.end());
+	return offset;
+}
+
+}
+
+CacheKey CacheKey::from_digest(Digest const & digest) {
+	CacheKey key;
+	key.bytes = digest;
+	return key;
+}
+
+std::string CacheKey::to_string() const {
+	char const digits[] = "0123456789abcdef";
+	std::string s;
+	s.reserve(bytes.size() * 2);
+	for (unsigned char b : bytes) {
+		s += digits[b >> 4];
+		s += digits[b & 0xF];
+	}
+	return s;
+}
+
+CacheEntry::CacheEntry(mstd::range<unsigned char const> data) try : data_(data) {
+	if (data_.size() < header_size || std::memcmp(data_.data(), magic, 4) != 0) throw 1;
+	if (uint32_at(data_, 0x04) != format_version) throw 2;
+	if (uint32_at(data_, 0x28) != data_.size()) throw 3;
+	n_resources_ = uint32_at(data_, 0x2C);
+	n_version_info_nodes_ = uint32_at(data_, 0x30);
+	nodes_offset_ = header_size + uint64_t(n_resources_) * resource_size;
+	strings_offset_ = nodes_offset_ + uint64_t(n_version_info_nodes_) * node_size;
+	if (strings_offset_ + uint64_t(uint32_at(data_, 0x34)) != data_.size()) throw 4;
+} catch (int error) {
+	throw std::runtime_error("Unable to read cache entry. (Error " + std::to_string(error) + ")");
+}
+
+CacheEntry::CacheEntry(MappedFile file) : CacheEntry(file.data()) {
+	file_ = std::move(file);
+}
+
+CacheKey CacheEntry::key() const {
+	CacheKey key;
+	std::memcpy(key.bytes.data(), data_.data() + 0x08, key.bytes.size());
+	return key;
+}
+
+CacheEntry::Resource CacheEntry::resource(size_t i) const {
+	size_t offset = header_size + i * resource_size;
+	Resource r;
+	r.type      = ResourceKey{uint32_at(data_, offset)};
+	r.name      = ResourceKey{uint32_at(data_, offset + 4)};
+	r.lang      = ResourceKey{uint32_at(data_, offset + 8)};
+	r.data_rva  = uint32_at(data_, offset + 12);
+	r.data_size = uint32_at(data_, offset + 16);
+	return r;
+}
+
+ResourceName CacheEntry::name(ResourceKey key) const {
+	if (!key.is_name()) return ResourceName(key.value);
+	auto data = data_.subrange(strings_offset_).subrange(key.name_offset());
+	if (data.size() < 2) return ResourceName(mstd::range<unsigned char const>());
+	size_t length = data[0] | data[1] << 8;
+	return ResourceName(data.subrange(2, length * 2));
+}
+
+ResourceId CacheEntry::id(Resource const & r) const {
+	return ResourceId(name(r.type).to_string(), name(r.name).to_string(), name(r.lang).to_string());
+}
+
+VersionInfoTree CacheEntry::version_info_tree() const try {
+	if (!has_version_info()) throw 5;
+	uint32_t const n = n_version_info_nodes_;
+	auto strings = data_.subrange(strings_offset_);
+
+	// Children and siblings always come after a node in depth-first order,
+	// so following them always ends.
+	auto check_index = [n] (uint32_t i, uint32_t after) {
+		if (i != VersionInfoNode::none && (i >= n || i <= after)) throw 6;
+	};
+
+	std::vector<VersionInfoNode> nodes(n);
+	for (uint32_t i = 0; i < n; ++i) {
+		size_t offset = nodes_offset_ + size_t(i) * node_size;
+		auto & node = nodes[i];
+		node.name         = strings.subrange(uint32_at(data_, offset), uint32_at(data_, offset + 4));
+		node.value        = strings.subrange(uint32_at(data_, offset + 8), uint32_at(data_, offset + 12));
+		node.is_string    = uint32_at(data_, offset + 16) != 0;
+		node.first_child  = uint32_at(data_, offset + 20);
+		node.next_sibling = uint32_at(data_, offset + 24);
+		check_index(node.first_child, i);
+		check_index(node.next_sibling, i);
+	}
+
+	uint32_t string_file_info = uint32_at(data_, 0x38);
+	uint32_t var_file_info = uint32_at(data_, 0x3C);
+	check_index(string_file_info, 0);
+	check_index(var_file_info, 0);
+
+	// There, since the constructor checked for header_size.
+	using F = layout::FixedFileInfo;
+	auto p = data_.data() + fixed_offset;
+	VersionInfo fixed = {};
+	fixed.signature       = F::signature::read(p);
+	fixed.struc_version   = F::struc_version::read(p);
+	fixed.file_version    = F::file_version::read(p);
+	fixed.product_version = F::product_version::read(p);
+	fixed.file_flags_mask = F::file_flags_mask::read(p);
+	fixed.file_flags      = F::file_flags::read(p);
+	fixed.file_os         = F::file_os::read(p);
+	fixed.file_type       = F::file_type::read(p);
+	fixed.file_subtype    = F::file_subtype::read(p);
+	fixed.file_date       = F::file_date::read(p);
+
+	return VersionInfoTree(std::move(fixed), std::move(nodes), string_file_info, var_file_info);
+} catch (int error) {
+	throw std::runtime_error("Unable to read cache entry. (Error " + std::to_string(error) + ")");
+}
+
+VersionInfo CacheEntry::version_info() const {
+	return version_info_tree().to_version_info();
+}
+
+std::vector<unsigned char> make_cache_entry(CacheKey const & key, ImageView const & image) {
+	std::vector<unsigned char> resources;
+	std::vector<unsigned char> nodes;
+	std::vector<unsigned char> strings;
+	uint32_t n_resources = 0;
+	uint32_t n_nodes = 0;
+
+	VersionInfoTree tree;
+
+	auto rsrc = std::find_if(image.sections.begin(), image.sections.end(), [] (SectionView const & s) {
+		return s.name == ".rsrc";
+	});
+
+	if (rsrc != image.sections.end()) {
+		ResourceTable table(rsrc->data, rsrc->virtual_address);
+
+		// Offsets of the names that were already copied, by their offset
+		// in the resource section.
+		std::map<uint32_t, uint32_t> names;
+		auto copy_key = [&] (ResourceKey key) {
+			if (!key.is_name()) return key;
+			auto n = names.find(key.name_offset());
+			if (n == names.end()) {
+				auto name = table.name(key);
+				unsigned char length[2];
+				write_uint16(length, name.size());
+				uint32_t offset = append_bytes(strings, length);
+				append_bytes(strings, name.bytes());
+				n = names.emplace(key.name_offset(), offset).first;
+			}
+			return ResourceKey{0x80000000 | n->second};
+		};
+
+		for (auto const & entry : table) {
+			append_uint32(resources, copy_key(entry.type).value);
+			append_uint32(resources, copy_key(entry.name).value);
+			append_uint32(resources, copy_key(entry.lang).value);
+			append_uint32(resources, rsrc->virtual_address + (entry.data.data() - rsrc->data.data()));
+			append_uint32(resources, entry.data.size());
+			++n_resources;
+		}
+
+		auto version_info = table.find(16);
+		if (!version_info.empty()) {
+			tree.parse(version_info.begin()->data);
+			for (auto const & node : tree.nodes()) {
+				append_uint32(nodes, append_bytes(strings, node.name));
+				append_uint32(nodes, node.name.size());
+				append_uint32(nodes, append_bytes(strings, node.value));
+				append_uint32(nodes, node.value.size());
+				append_uint32(nodes, node.is_string);
+				append_uint32(nodes, node.first_child);
+				append_uint32(nodes, node.next_sibling);
+				++n_nodes;
+			}
+		}
+	}
+
+	auto const & fixed = tree.fixed();
+
+	std::vector<unsigned char> out;
+	out.reserve(header_size + resources.size() + nodes.size() + strings.size());
+	out.insert(out.end(), magic, magic + 4);
+	append_uint32(out, format_version);
+	out.insert(out.end(), key.bytes.begin(), key.bytes.end());
+	append_uint32(out, header_size + resources.size() + nodes.size() + strings.size());
+	append_uint32(out, n_resources);
+	append_uint32(out, n_nodes);
+	append_uint32(out, strings.size());
+	append_uint32(out, tree.string_file_info());
+	append_uint32(out, tree.var_file_info());
+	using F = layout::FixedFileInfo;
+	out.resize(fixed_offset + F::size);
+	auto p = &out[fixed_offset];
+	F::signature::write(p, fixed.signature);
+	F::struc_version::write(p, fixed.struc_version);
+	F::file_version::write(p, fixed.file_version);
+	F::product_version::write(p, fixed.product_version);
+	F::file_flags_mask::write(p, fixed.file_flags_mask);
+	F::file_flags::write(p, fixed.file_flags);
+	F::file_os::write(p, fixed.file_os);
+	F::file_type::write(p, fixed.file_type);
+	F::file_subtype::write(p, fixed.file_subtype);
+	F::file_date::write(p, fixed.file_date);
+	out.insert(out.end(), resources.begin(), resources.end());
+	out.insert(out.end(), nodes.begin(), nodes.end());
+	out.insert(out.end(), strings.begin(), strings.end());
+	return out;
+}
+
+#ifndef WIN32
+
+namespace {
+
+struct FileIdentity {
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+};
+
+FileIdentity file_identity(struct stat const & s) {
+#ifdef __APPLE__
+	int64_t nsec = s.st_mtimespec.tv_nsec;
+#else
+	int64_t nsec = s.st_mtim.tv_nsec;
+#endif
+	return {uint64_t(s.st_dev), uint64_t(s.st_ino), uint64_t(s.st_size), int64_t(s.st_mtime), nsec};
+}
+
+CacheKey identity_key(FileIdentity const & id) {
+	// Hashed with a prefix, so it can't be mistaken for a digest.
+	Sha256 sha;
+	unsigned char const prefix[] = "PE file identity";
+	sha.update({prefix, sizeof(prefix)});
+	for (uint64_t v : {id.device, id.inode, id.size, uint64_t(id.mtime), uint64_t(id.mtime_nsec)}) {
+		unsigned char bytes[8];
+		for (int i = 0; i < 8; ++i) bytes[i] = v >> (8 * i);
+		sha.update(bytes);
+	}
+	return CacheKey::from_digest(sha.finish());
+}
+
+bool is_entry_name(char const * name) {
+	size_t n = 0;
+	for (; name[n]; ++n) {
+		if (!((name[n] >= '0' && name[n] <= '9') || (name[n] >= 'a' && name[n] <= 'f'))) return false;
+	}
+	return n == 64;
+}
+
+bool ends_with(std::string const & s, char const * suffix) {
+	size_t n = std::strlen(suffix);
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Temporary files that haven't been renamed for this long are from processes
+// that didn't finish writing them.
+time_t const abandoned_after = 60 * 60;
+
+struct CacheFile {
+	std::string path;
+	uint64_t size;
+	FileIdentity identity;
+};
+
+// All entries in the directory, optionally removing abandoned temporary files.
+std::vector<CacheFile> list_cache_files(std::string const & directory, bool remove_abandoned) {
+	std::vector<CacheFile> files;
+	DIR * dir = opendir(directory.c_str());
+	if (!dir) return files;
+	time_t now = time(nullptr);
+	while (dirent * e = readdir(dir)) {
+		std::string path = directory + "/" + e->d_name;
+		bool entry = is_entry_name(e->d_name);
+		if (!entry && !(remove_abandoned && ends_with(path, ".tmp"))) continue;
+		struct stat s;
+		if (stat(path.c_str(), &s) != 0 || !S_ISREG(s.st_mode)) continue;
+		if (entry) {
+			files.push_back({std::move(path), uint64_t(s.st_size), file_identity(s)});
+		} else if (s.st_mtime + abandoned_after < now) {
+			unlink(path.c_str());
+		}
+	}
+	closedir(dir);
+	return files;
+}
+
+// Write an entry to a new temporary file next to path, for renaming to path.
+std::string write_temporary(std::string const & path, mstd::range<unsigned char const> data) {
+	static std::atomic<unsigned> counter{0};
+	std::string temp = path + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+
+	FILE * file = std::fopen(temp.c_str(), "wb");
+	if (!file) throw std::runtime_error("Unable to write cache entry.");
+	bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+	if (std::fclose(file) != 0) ok = false;
+	if (!ok) {
+		std::remove(temp.c_str());
+		throw std::runtime_error("Unable to write cache entry.");
+	}
+	return temp;
+}
+
+}
+
+CacheKey CacheKey::from_file_identity(char const * file_name) {
+	struct stat s;
+	if (stat(file_name, &s) != 0) throw std::runtime_error("Unable to open file.");
+	return identity_key(file_identity(s));
+}
+
+CacheKey CacheKey::from_file_identity(int file_descriptor) {
+	struct stat s;
+	if (fstat(file_descriptor, &s) != 0) throw std::runtime_error("Unable to open file.");
+	return identity_key(file_identity(s));
+}
+
+ResourceCache::ResourceCache(std::string directory, uint64_t max_size)
+	: directory_(std::move(directory)), max_size_(max_size) {
+	if (mkdir(directory_.c_str(), 0777) != 0 && errno != EEXIST) {
+		throw std::runtime_error("Unable to create cache directory.");
+	}
+	uint64_t size = 0;
+	for (auto const & f : list_cache_files(directory_, false)) size += f.size;
+	size_ = size;
+}
+
+std::string ResourceCache::path(CacheKey const & key) const {
+	return directory_ + "/" + key.to_string();
+}
+
+std::unique_ptr<CacheEntry const> ResourceCache::find(CacheKey const & key) const {
+	std::string p = path(key);
+	if (access(p.c_str(), R_OK) != 0) return nullptr;
+	try {
+		MappedFile file(p.c_str());
+		// The modification time of an entry is when it was last used. Only
+		// its owner (or someone who may write to it) can set that, so an
+		// entry of another user is copied into a new one of our own instead.
+		// If that fails too, the entry just looks older than it is.
+		int error = futimens(file.file_descriptor(), nullptr) == 0 ? 0 : errno;
+		auto entry = std::make_unique<CacheEntry const>(std::move(file));
+		if (entry->key() != key) return nullptr;
+		if (error == EPERM || error == EACCES) {
+			try {
+				std::string temp = write_temporary(p, entry->bytes());
+				if (std::rename(temp.c_str(), p.c_str()) != 0) std::remove(temp.c_str());
+			} catch (std::exception const &) {
+			}
+		}
+		return entry;
+	} catch (std::exception const &) {
+		// Removed in the meantime, or corrupt.
+		return nullptr;
+	}
+}
+
+std::unique_ptr<CacheEntry const> ResourceCache::insert(CacheKey const & key, ImageView const & image) {
+	auto data = make_cache_entry(key, image);
+
+	std::string p = path(key);
+	std::string temp = write_temporary(p, data);
+
+	// Mapped before it's renamed, since another process could replace or
+	// remove it right after.
+	std::unique_ptr<CacheEntry const> entry;
+	try {
+		entry = std::make_unique<CacheEntry const>(MappedFile(temp.c_str()));
+	} catch (...) {
+		std::remove(temp.c_str());
+		throw;
+	}
+	if (std::rename(temp.c_str(), p.c_str()) != 0) {
+		std::remove(temp.c_str());
+		throw std::runtime_error("Unable to rename file.");
+	}
+
+	if ((size_ += data.size()) > max_size_) trim();
+
+	return entry;
+}
+
+std::unique_ptr<CacheEntry const> ResourceCache::get(char const * file_name, CacheKeyMode mode) {
+	// The key is computed from the opened file, so it matches what's parsed,
+	// even if the file is replaced in the meantime.
+	MappedFile file(file_name);
+	CacheKey key = mode == CacheKeyMode::file_identity
+		? CacheKey::from_file_identity(file.file_descriptor())
+		: CacheKey::from_digest(image_digest(file.data()));
+	if (auto entry = find(key)) return entry;
+	MappedImage image(std::move(file));
+	return insert(key, image.view());
+}
+
+void ResourceCache::trim() {
+	std::lock_guard<std::mutex> lock(trim_mutex_);
+
+	auto files = list_cache_files(directory_, true);
+	uint64_t size = 0;
+	for (auto const & f : files) size += f.size;
+
+	std::sort(files.begin(), files.end(), [] (CacheFile const & a, CacheFile const & b) {
+		auto const & x = a.identity;
+		auto const & y = b.identity;
+		return x.mtime < y.mtime || (x.mtime == y.mtime && x.mtime_nsec < y.mtime_nsec);
+	});
+
+	// Trimming to less than max_size, so it doesn't happen again on the
+	// next insert.
+	uint64_t target = max_size_ / 4 * 3;
+	for (auto const & f : files) {
+		if (size <= target) break;
+		// Another process might have removed it already.
+		unlink(f.path.c_str());
+		size -= f.size;
+	}
+
+	size_ = size;
+}
+
+#endif
+
+}
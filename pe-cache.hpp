@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe-digest.hpp"
+#include "pe-map.hpp"
+#include "pe-res.hpp"
+#include "pe.hpp"
+
+namespace PE {
+
+// Identifies a PE file in a ResourceCache.
+struct CacheKey {
+	std::array<unsigned char, 32> bytes;
+
+	// By the contents of the file, as computed by image_digest.
+	static CacheKey from_digest(Digest const &);
+
+#ifndef WIN32
+	// By the device, inode, size and modification time of the file. Much
+	// cheaper than a digest, but a file that's modified without changing its
+	// size or modification time keeps the same key.
+	static CacheKey from_file_identity(char const * file_name);
+	static CacheKey from_file_identity(int file_descriptor);
+#endif
+
+	// In hexadecimal, as used for the file names in the cache.
+	std::string to_string() const;
+
+	friend bool operator == (CacheKey const & a, CacheKey const & b) { return a.bytes == b.bytes; }
+	friend bool operator != (CacheKey const & a, CacheKey const & b) { return a.bytes != b.bytes; }
+};
+
+// The resource index and the (first) version information of a PE file, in
+// the format stored by ResourceCache.
+//
+// Everything is read directly from the bytes of the entry, e.g. a mapped
+// cache file, without parsing it first. Only the sizes are checked when it's
+// opened. The format is little-endian, and consists of a header, followed by
+// the resources, the version information nodes, and the names and values they
+// refer to.
+class CacheEntry {
+public:
+	// A resource as in ResourceTable::Entry. Names are stored in the entry,
+	// but the data isn't: data_rva refers to the PE file.
+	struct Resource {
+		ResourceKey type;
+		ResourceKey name;
+		ResourceKey lang;
+		uint32_t data_rva;
+		uint32_t data_size;
+	};
+
+	// The bytes must outlive the entry.
+	explicit CacheEntry(mstd::range<unsigned char const>);
+	explicit CacheEntry(MappedFile);
+
+	mstd::range<unsigned char const> bytes() const { return data_; }
+
+	CacheKey key() const;
+
+	// In the same order as in ResourceTable.
+	size_t n_resources() const { return n_resources_; }
+	Resource resource(size_t i) const;
+
+	ResourceName name(ResourceKey) const;
+	ResourceId id(Resource const &) const;
+
+	bool has_version_info() const { return n_version_info_nodes_ != 0; }
+
+	// The version information, as it was parsed by VersionInfoTree. The
+	// nodes refer to this entry. Throws if it's corrupt.
+	VersionInfoTree version_info_tree() const;
+
+	VersionInfo version_info() const;
+
+private:
+	MappedFile file_;
+	mstd::range<unsigned char const> data_;
+	uint32_t n_resources_ = 0;
+	uint32_t n_version_info_nodes_ = 0;
+	size_t nodes_offset_ = 0;
+	size_t strings_offset_ = 0;
+};
+
+// Parse the resources and the version information of a PE file, and store
+// them in the format of a CacheEntry. Throws if they can't be parsed.
+std::vector<unsigned char> make_cache_entry(CacheKey const &, ImageView const &);
+
+#ifndef WIN32
+
+enum class CacheKeyMode {
+	file_identity,
+	digest,
+};
+
+// A directory with a CacheEntry for every PE file that was looked up, so
+// that the resources and version information of files that were seen before
+// don't have to be parsed again.
+//
+// The directory can be shared by several processes (and threads). Entries
+// are written to a temporary file and renamed, so a reader never sees a
+// partially written entry, and entries that are in use stay valid when
+// they're replaced or removed.
+//
+// When the total size of the entries exceeds max_size, the least recently
+// used ones are removed. The size of entries written by other processes is
+// only noticed when trimming, so the directory can briefly exceed max_size.
+//
+// When an entry was last used is its modification time, which only its owner
+// can update, so an entry of another user is copied into a new one instead.
+// Processes of different users can share the directory as long as all of
+// them may write to it.
+class ResourceCache {
+public:
+	// Creates the directory if it doesn't exist.
+	explicit ResourceCache(std::string directory, uint64_t max_size = uint64_t(64) << 20);
+
+	// The entry for a key, or null if there is none (or it's corrupt).
+	std::unique_ptr<CacheEntry const> find(CacheKey const &) const;
+
+	// Parse an image and store its entry, replacing any existing entry.
+	std::unique_ptr<CacheEntry const> insert(CacheKey const &, ImageView const &);
+
+	// Find the entry for a PE file, or map and parse the file and insert it.
+	std::unique_ptr<CacheEntry const> get(char const * file_name, CacheKeyMode = CacheKeyMode::file_identity);
+
+	// Remove the least recently used entries until they take at most three
+	// quarters of max_size, and remove abandoned temporary files.
+	void trim();
+
+private:
+	std::string path(CacheKey const &) const;
+
+	std::string directory_;
+	uint64_t max_size_;
+	std::atomic<uint64_t> size_{0};
+	std::mutex trim_mutex_;
+};
+
+#endif
+
+}
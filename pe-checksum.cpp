@@ -0,0 +1,172 @@
+#include <algorithm>
+
+#if !defined(PE_CHECKSUM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PE_CHECKSUM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(PE_CHECKSUM_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PE_CHECKSUM_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "pe-checksum.hpp"
+#include "pe-headers.hpp"
+#include "pe-map.hpp"
+
+namespace PE {
+
+namespace {
+
+// The kernels add up the 16-bit little-endian words of n bytes (n even).
+//
+// They're free to add up 32-bit words instead, or to not fold carries back
+// in, since the result is only used modulo 0xFFFF (and 0x10000 is 1 modulo
+// 0xFFFF). The sum is folded into 16 bits at the end.
+
+uint64_t sum_scalar(unsigned char const * p, size_t n) {
+	uint64_t sum = 0;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		sum += p[i + 0] | p[i + 1] << 8 | p[i + 2] << 16 | uint32_t(p[i + 3]) << 24;
+		sum += p[i + 4] | p[i + 5] << 8 | p[i + 6] << 16 | uint32_t(p[i + 7]) << 24;
+	}
+	for (; i < n; i += 2) sum += p[i] | p[i + 1] << 8;
+	return sum;
+}
+
+#ifdef PE_CHECKSUM_SSE2
+uint64_t sum_sse2(unsigned char const * p, size_t n) {
+	__m128i const zero = _mm_setzero_si128();
+	__m128i const low = _mm_set1_epi32(0xFFFF);
+	__m128i total = zero;
+	size_t i = 0;
+	while (i + 16 <= n) {
+		// Every step adds less than 2^17 to each 32-bit lane, so this can
+		// take 2^14 steps before the lanes need to be widened.
+		size_t end = std::min(n, i + (size_t(16) << 14));
+		__m128i sum = zero;
+		for (; i + 16 <= end; i += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + i));
+			sum = _mm_add_epi32(sum, _mm_and_si128(v, low));
+			sum = _mm_add_epi32(sum, _mm_srli_epi32(v, 16));
+		}
+		total = _mm_add_epi64(total, _mm_unpacklo_epi32(sum, zero));
+		total = _mm_add_epi64(total, _mm_unpackhi_epi32(sum, zero));
+	}
+	alignas(16) uint64_t t[2];
+	_mm_store_si128(reinterpret_cast<__m128i *>(t), total);
+	return t[0] + t[1] + sum_scalar(p + i, n - i);
+}
+#endif
+
+#ifdef PE_CHECKSUM_AVX2
+__attribute__((target("avx2")))
+uint64_t sum_avx2(unsigned char const * p, size_t n) {
+	__m256i const zero = _mm256_setzero_si256();
+	__m256i const low = _mm256_set1_epi32(0xFFFF);
+	__m256i total = zero;
+	size_t i = 0;
+	while (i + 32 <= n) {
+		// As in sum_sse2.
+		size_t end = std::min(n, i + (size_t(32) << 14));
+		__m256i sum = zero;
+		for (; i + 32 <= end; i += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p + i));
+			sum = _mm256_add_epi32(sum, _mm256_and_si256(v, low));
+			sum = _mm256_add_epi32(sum, _mm256_srli_epi32(v, 16));
+		}
+		total = _mm256_add_epi64(total, _mm256_unpacklo_epi32(sum, zero));
+		total = _mm256_add_epi64(total, _mm256_unpackhi_epi32(sum, zero));
+	}
+	alignas(32) uint64_t t[4];
+	_mm256_store_si256(reinterpret_cast<__m256i *>(t), total);
+	return t[0] + t[1] + t[2] + t[3] + sum_sse2(p + i, n - i);
+}
+#endif
+
+using Kernel = uint64_t (*)(unsigned char const *, size_t);
+
+Kernel select_kernel() {
+#ifdef PE_CHECKSUM_AVX2
+	if (__builtin_cpu_supports("avx2")) return sum_avx2;
+#endif
+#ifdef PE_CHECKSUM_SSE2
+	return sum_sse2;
+#else
+	return sum_scalar;
+#endif
+}
+
+uint64_t sum_words(unsigned char const * p, size_t n) {
+	static Kernel const kernel = select_kernel();
+	return kernel(p, n);
+}
+
+uint32_t fold(uint64_t sum) {
+	while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+}
+
+void Checksum::update(mstd::range<unsigned char const> data) {
+	unsigned char const * p = data.data();
+	size_t n = data.size();
+	if (n == 0) return;
+	size_ += n;
+	// A byte at an odd offset is the high half of a word.
+	if ((size_ - n) % 2) {
+		sum_ += *p++ << 8;
+		--n;
+	}
+	sum_ += sum_words(p, n & ~size_t(1));
+	if (n % 2) sum_ += p[n - 1];
+	sum_ = fold(sum_);
+}
+
+void Checksum::append(Checksum const & next) {
+	uint64_t sum = fold(next.sum_);
+	// After an odd number of bytes, every byte of next is in the other half
+	// of its word. Swapping the halves of all words swaps the halves of their
+	// sum, since 0x10000 is 1 modulo 0xFFFF.
+	if (size_ % 2) sum = (sum >> 8 | sum << 8) & 0xFFFF;
+	sum_ = fold(sum_ + sum);
+	size_ += next.size_;
+}
+
+uint32_t Checksum::value() const {
+	return fold(sum_) + uint32_t(size_);
+}
+
+uint32_t compute_checksum(mstd::range<unsigned char const> file) {
+	size_t offset = ImageHeaders(file).checksum_offset();
+	Checksum checksum;
+	checksum.update(file.subrange(0, offset));
+	checksum.skip(4);
+	checksum.update(file.subrange(offset + 4));
+	return checksum.value();
+}
+
+uint32_t compute_checksum(MappedImage const & image) {
+	return compute_checksum(image.data());
+}
+
+char const * check_checksum_kernels(mstd::range<unsigned char const> data) {
+#ifdef PE_CHECKSUM_SSE2
+	unsigned char const * p = data.data();
+	size_t n = data.size() & ~size_t(1);
+	// The kernels may sum differently, but not after folding.
+	uint32_t expected = fold(sum_scalar(p, n));
+	if (fold(sum_sse2(p, n)) != expected) return "sse2";
+#ifdef PE_CHECKSUM_AVX2
+	if (__builtin_cpu_supports("avx2") && fold(sum_avx2(p, n)) != expected) return "avx2";
+#endif
+#else
+	// There's only the portable code.
+	(void)data;
+#endif
+	return nullptr;
+}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <mstd/range.hpp>
+
+namespace PE {
+
+class MappedImage;
+
+// The PE checksum, as stored in the CheckSum field of the optional header:
+// the 16-bit one's complement sum of the file, plus the size of the file.
+//
+// The file can be added in pieces of any size. The CheckSum field itself
+// should be added as zeros (or skipped).
+class Checksum {
+public:
+	void update(mstd::range<unsigned char const>);
+
+	// Add n zero bytes.
+	void skip(size_t n) { size_ += n; }
+
+	// Add the bytes that another checksum was computed over, as if they
+	// followed everything added so far. This way, the pieces of a file can
+	// be summed separately, e.g. on different threads.
+	void append(Checksum const &);
+
+	uint64_t size() const { return size_; }
+
+	// The checksum of everything added so far.
+	uint32_t value() const;
+
+private:
+	uint64_t sum_ = 0;
+	uint64_t size_ = 0;
+};
+
+// The checksum of a complete file, skipping the CheckSum field.
+uint32_t compute_checksum(mstd::range<unsigned char const> file);
+uint32_t compute_checksum(MappedImage const &);
+
+// Compare the SIMD code this CPU supports with the portable code on the
+// given bytes, e.g. to test it. Returns the name of the first kernel that
+// gives a different sum ("sse2" or "avx2"), or null if they all agree.
+char const * check_checksum_kernels(mstd::range<unsigned char const>);
+
+}
@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "pe-bytes.hpp"
+#include "pe-checksum.hpp"
+#include "pe-digest.hpp"
+#include "pe-headers.hpp"
+#include "pe-map.hpp"
+#include "pe-plan.hpp"
+
+namespace PE {
+
+namespace {
+
+uint32_t const round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+uint32_t rotate(uint32_t x, int n) {
+	return x >> n | x << (32 - n);
+}
+
+// The SHA-256 of the file size and the digests of the blocks.
+Digest combine(uint64_t size, std::vector<Digest> const & blocks) {
+	unsigned char size_bytes[8];
+	for (int i = 0; i < 8; ++i) size_bytes[i] = size >> (8 * i);
+	Sha256 sha;
+	sha.update(size_bytes);
+	for (auto const & b : blocks) sha.update(b);
+	return sha.finish();
+}
+
+}
+
+Sha256::Sha256() : state_{
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+} {}
+
+void Sha256::process(unsigned char const * block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; ++i) {
+		w[i] = uint32_t(block[4 * i]) << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+	}
+	for (int i = 16; i < 64; ++i) {
+		uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ w[i - 15] >> 3;
+		uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ w[i - 2] >> 10;
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+	uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+	for (int i = 0; i < 64; ++i) {
+		uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + round_constants[i] + w[i];
+		uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state_[0] += a; state_[1] += b; state_[2] += c; state_[3] += d;
+	state_[4] += e; state_[5] += f; state_[6] += g; state_[7] += h;
+}
+
+void Sha256::update(mstd::range<unsigned char const> data) {
+	unsigned char const * p = data.data();
+	size_t n = data.size();
+	size_t buffered = size_ % 64;
+	size_ += n;
+	if (buffered) {
+		size_t m = std::min(n, 64 - buffered);
+		std::memcpy(buffer_ + buffered, p, m);
+		p += m;
+		n -= m;
+		if (buffered + m < 64) return;
+		process(buffer_);
+	}
+	for (; n >= 64; p += 64, n -= 64) process(p);
+	if (n) std::memcpy(buffer_, p, n);
+}
+
+Digest Sha256::finish() {
+	uint64_t bits = size_ * 8;
+	unsigned char padding[72] = {0x80};
+	size_t n = 64 - (size_ + 8) % 64;
+	for (int i = 0; i < 8; ++i) padding[n + i] = bits >> (56 - 8 * i);
+	update({padding, n + 8});
+	Digest digest;
+	for (int i = 0; i < 8; ++i) {
+		digest[4 * i + 0] = state_[i] >> 24;
+		digest[4 * i + 1] = state_[i] >> 16;
+		digest[4 * i + 2] = state_[i] >> 8;
+		digest[4 * i + 3] = state_[i];
+	}
+	return digest;
+}
+
+std::vector<ByteRange> authenticode_exclusions(mstd::range<unsigned char const> headers) {
+	ImageHeaders h(headers);
+	std::vector<ByteRange> excluded;
+	excluded.push_back({h.checksum_offset(), 4});
+	if (h.n_data_directories() > security_directory) {
+		excluded.push_back({h.data_directory_offset(security_directory), 8});
+		// Unlike other data directories, this one has a file offset.
+		auto certificates = h.data_directory(security_directory);
+		if (certificates.size) excluded.push_back({certificates.virtual_address, certificates.size});
+	}
+	std::sort(excluded.begin(), excluded.end(), [] (ByteRange a, ByteRange b) { return a.offset < b.offset; });
+	std::vector<ByteRange> merged;
+	for (auto r : excluded) {
+		if (!merged.empty() && r.offset <= merged.back().offset + merged.back().size) {
+			merged.back().size = std::max(merged.back().size, r.offset + r.size - merged.back().offset);
+		} else {
+			merged.push_back(r);
+		}
+	}
+	return merged;
+}
+
+constexpr size_t ImageDigest::block_size;
+
+ImageDigest::ImageDigest(std::vector<ByteRange> excluded) : excluded_(std::move(excluded)) {}
+
+void ImageDigest::update(mstd::range<unsigned char const> data) {
+	unsigned char const * p = data.data();
+	size_t n = data.size();
+	while (n) {
+		while (next_excluded_ < excluded_.size() && excluded_[next_excluded_].offset + excluded_[next_excluded_].size <= offset_) {
+			++next_excluded_;
+		}
+		size_t m = n;
+		if (next_excluded_ < excluded_.size()) {
+			auto const & e = excluded_[next_excluded_];
+			if (e.offset <= offset_) {
+				m = std::min<uint64_t>(n, e.offset + e.size - offset_);
+				p += m;
+				n -= m;
+				offset_ += m;
+				continue;
+			}
+			m = std::min<uint64_t>(n, e.offset - offset_);
+		}
+		add(p, m);
+		p += m;
+		n -= m;
+		offset_ += m;
+	}
+}
+
+void ImageDigest::patch(uint64_t offset, mstd::range<unsigned char const> data) {
+	uint64_t excluded_before = 0;
+	size_t e = 0;
+	for (size_t i = 0; i < data.size(); ++i) {
+		uint64_t o = offset + i;
+		while (e < excluded_.size() && excluded_[e].offset + excluded_[e].size <= o) {
+			excluded_before += excluded_[e++].size;
+		}
+		if (e < excluded_.size() && excluded_[e].offset <= o) continue;
+		assert(o - excluded_before < first_block_.size());
+		first_block_[o - excluded_before] = data[i];
+	}
+}
+
+void ImageDigest::add(unsigned char const * data, size_t size) {
+	if (size && size_ < block_size) {
+		if (size_ == 0) blocks_.emplace_back(); // Hashed by finish().
+		size_t m = std::min<uint64_t>(size, block_size - size_);
+		first_block_.insert(first_block_.end(), data, data + m);
+		data += m;
+		size -= m;
+		size_ += m;
+	}
+	while (size) {
+		size_t m = std::min<uint64_t>(size, block_size - size_ % block_size);
+		block_.update({data, m});
+		data += m;
+		size -= m;
+		size_ += m;
+		if (size_ % block_size == 0) {
+			blocks_.push_back(block_.finish());
+			block_ = Sha256();
+		}
+	}
+}
+
+Digest ImageDigest::finish() {
+	if (size_ > block_size && size_ % block_size) blocks_.push_back(block_.finish());
+	if (size_) {
+		Sha256 sha;
+		sha.update(first_block_);
+		blocks_[0] = sha.finish();
+	}
+	return combine(size_, blocks_);
+}
+
+namespace {
+
+// Threads that help hash the blocks of every image_digest, started when
+// they're first needed and kept until the process exits, so hashing many
+// small files doesn't start threads for every file.
+class HelperPool {
+public:
+	~HelperPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		cv_.notify_all();
+		for (auto & t : threads_) t.join();
+	}
+
+	// Run work on the calling thread, and on up to n_helpers threads of the
+	// pool that are idle before the calling thread is done with it. Returns
+	// when all of them have returned.
+	void run(std::function<void ()> const & work, size_t n_helpers) {
+		Job job{&work, 0};
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			while (threads_.size() < n_helpers) threads_.emplace_back([this] { help(); });
+			for (size_t i = 0; i < n_helpers; ++i) jobs_.push_back(&job);
+		}
+		cv_.notify_all();
+
+		work();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		jobs_.erase(std::remove(jobs_.begin(), jobs_.end(), &job), jobs_.end());
+		done_.wait(lock, [&] { return job.running == 0; });
+	}
+
+	static HelperPool & instance() {
+		static HelperPool pool;
+		return pool;
+	}
+
+private:
+	struct Job {
+		std::function<void ()> const * work;
+		size_t running;
+	};
+
+	void help() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			cv_.wait(lock, [&] { return stop_ || !jobs_.empty(); });
+			if (stop_) return;
+			Job * job = jobs_.front();
+			jobs_.pop_front();
+			++job->running;
+			lock.unlock();
+			(*job->work)();
+			lock.lock();
+			if (--job->running == 0) done_.notify_all();
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::condition_variable done_;
+	std::deque<Job *> jobs_;
+	std::vector<std::thread> threads_;
+	bool stop_ = false;
+};
+
+// The digest of a file given as consecutive parts, with the same result as
+// ImageDigest, but with the blocks hashed in parallel.
+//
+// If plan is given, the parts are its chunks, without exclusions, and the
+// CheckSum field in its head is computed along with the digests of the
+// blocks. The blocks that contain the field are hashed once it's filled in.
+Digest parallel_digest(
+	std::vector<mstd::range<unsigned char const>> const & parts,
+	std::vector<ByteRange> const & excluded,
+	unsigned n_threads,
+	WritePlan * plan = nullptr
+) {
+	// The parts that remain after leaving out the excluded ranges, and where
+	// they start after that.
+	std::vector<mstd::range<unsigned char const>> segments;
+	std::vector<uint64_t> starts;
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	size_t next_excluded = 0;
+	for (auto part : parts) {
+		while (!part.empty()) {
+			while (next_excluded < excluded.size() && excluded[next_excluded].offset + excluded[next_excluded].size <= offset) {
+				++next_excluded;
+			}
+			size_t m = part.size();
+			bool skip = false;
+			if (next_excluded < excluded.size()) {
+				auto const & e = excluded[next_excluded];
+				skip = e.offset <= offset;
+				m = std::min<uint64_t>(m, skip ? e.offset + e.size - offset : e.offset - offset);
+			}
+			if (!skip) {
+				segments.push_back(part.subrange(0, m));
+				starts.push_back(size);
+				size += m;
+			}
+			part.remove_prefix(m);
+			offset += m;
+		}
+	}
+
+	size_t n_blocks = (size + ImageDigest::block_size - 1) / ImageDigest::block_size;
+	std::vector<Digest> blocks(n_blocks);
+
+	// Pass the bytes of block i to sha and checksum, if given.
+	auto read_block = [&] (size_t i, Sha256 * sha, Checksum * checksum) {
+		uint64_t begin = uint64_t(i) * ImageDigest::block_size;
+		uint64_t end = std::min<uint64_t>(begin + ImageDigest::block_size, size);
+		size_t s = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+		for (uint64_t o = begin; o < end; ++s) {
+			auto d = segments[s].subrange(o - starts[s], end - o);
+			if (sha) sha->update(d);
+			if (checksum) checksum->update(d);
+			o += d.size();
+		}
+	};
+
+	std::vector<Checksum> checksums(plan ? n_blocks : 0);
+	size_t held_begin = n_blocks;
+	size_t held_end = n_blocks;
+	if (plan) {
+		assert(excluded.empty());
+		held_begin = plan->checksum_offset / ImageDigest::block_size;
+		held_end = std::min(n_blocks, (plan->checksum_offset + 4 + ImageDigest::block_size - 1) / ImageDigest::block_size);
+	}
+
+	std::atomic<size_t> next_block{0};
+	auto worker = [&] {
+		size_t i;
+		while ((i = next_block++) < n_blocks) {
+			bool held = i >= held_begin && i < held_end;
+			Sha256 sha;
+			read_block(i, held ? nullptr : &sha, plan ? &checksums[i] : nullptr);
+			if (!held) blocks[i] = sha.finish();
+		}
+	};
+
+	if (n_threads == 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+	n_threads = std::min<size_t>(n_threads, n_blocks);
+
+	if (n_threads <= 1) worker();
+	else HelperPool::instance().run(worker, n_threads - 1);
+
+	if (plan) {
+		Checksum checksum;
+		for (auto const & c : checksums) checksum.append(c);
+		write_uint32(&plan->head[plan->checksum_offset], checksum.value());
+		for (size_t i = held_begin; i < held_end; ++i) {
+			Sha256 sha;
+			read_block(i, &sha, nullptr);
+			blocks[i] = sha.finish();
+		}
+	}
+
+	return combine(size, blocks);
+}
+
+}
+
+Digest image_digest(mstd::range<unsigned char const> file, DigestMode mode, unsigned n_threads) {
+	std::vector<ByteRange> excluded;
+	if (mode == DigestMode::authenticode) excluded = authenticode_exclusions(file);
+	return parallel_digest({file}, excluded, n_threads);
+}
+
+Digest image_digest(PortableExecutable const & pe, DigestMode mode, unsigned n_threads) {
+	WritePlan plan = plan_pe_file(pe);
+	std::vector<mstd::range<unsigned char const>> parts;
+	parts.reserve(plan.chunks.size());
+	for (auto const & c : plan.chunks) parts.emplace_back(c.data, c.size);
+	// The CheckSum field is left out of authenticode digests, so it's only
+	// computed for whole-file digests.
+	if (mode == DigestMode::authenticode) return parallel_digest(parts, authenticode_exclusions(plan.head), n_threads);
+	return parallel_digest(parts, {}, n_threads, &plan);
+}
+
+Digest image_digest(MappedImage const & image, DigestMode mode, unsigned n_threads) {
+	return image_digest(image.data(), mode, n_threads);
+}
+
+Digest write_pe_file_with_digest(char const * file_name, PortableExecutable const & pe, DigestMode mode) {
+	std::vector<ByteRange> excluded;
+	if (mode == DigestMode::authenticode) excluded = authenticode_exclusions(pe.headers);
+	ImageDigest digest(std::move(excluded));
+	uint64_t written = 0;
+	write_pe_file(file_name, pe, [&] (uint64_t offset, mstd::range<unsigned char const> data) {
+		if (offset < written) {
+			digest.patch(offset, data);
+		} else {
+			digest.update(data);
+			written += data.size();
+		}
+	});
+	return digest.finish();
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe.hpp"
+
+namespace PE {
+
+class MappedImage;
+
+using Digest = std::array<unsigned char, 32>;
+
+class Sha256 {
+public:
+	Sha256();
+	void update(mstd::range<unsigned char const>);
+	Digest finish();
+
+private:
+	void process(unsigned char const * block);
+
+	uint32_t state_[8];
+	unsigned char buffer_[64];
+	uint64_t size_ = 0;
+};
+
+struct ByteRange {
+	size_t offset;
+	size_t size;
+};
+
+// The parts of a file that an Authenticode signature doesn't cover: the
+// CheckSum field, the security data directory entry, and the certificate
+// table it refers to. Sorted, and without overlap.
+std::vector<ByteRange> authenticode_exclusions(mstd::range<unsigned char const> headers);
+
+enum class DigestMode {
+	// All bytes of the file.
+	whole_file,
+
+	// All bytes except for authenticode_exclusions, so the digest doesn't
+	// change when a file is (re-)signed or its checksum is updated.
+	authenticode,
+};
+
+// The digest of a file, computed as a tree: the SHA-256 of the file size and
+// the SHA-256 digests of every block of block_size bytes.
+//
+// The blocks are independent, so they can be hashed in parallel (see
+// image_digest), but they can also be hashed as the file is written. Both
+// give the same result.
+class ImageDigest {
+public:
+	static constexpr size_t block_size = size_t(1) << 20;
+
+	// The excluded ranges are left out (and not counted in the size). They
+	// must be sorted, and not overlap.
+	explicit ImageDigest(std::vector<ByteRange> excluded = {});
+
+	// Add the next bytes of the file.
+	void update(mstd::range<unsigned char const>);
+
+	// Replace bytes that were already added, at the given offset in the
+	// file, e.g. to fill in the CheckSum field once it's known. The first
+	// block is only hashed by finish(), so only its bytes can be replaced.
+	void patch(uint64_t offset, mstd::range<unsigned char const>);
+
+	Digest finish();
+
+private:
+	void add(unsigned char const * data, size_t size);
+
+	std::vector<ByteRange> excluded_;
+	size_t next_excluded_ = 0;
+	uint64_t offset_ = 0; // In the file.
+	uint64_t size_ = 0; // Not counting the excluded ranges.
+	std::vector<unsigned char> first_block_;
+	Sha256 block_;
+	std::vector<Digest> blocks_;
+};
+
+// The digest of a file, of the file write_pe_file would write, or of a mapped
+// file, with the blocks hashed on n_threads threads (zero for one per core):
+// the calling thread, and threads that are started once and shared by all
+// calls.
+Digest image_digest(mstd::range<unsigned char const> file, DigestMode = DigestMode::whole_file, unsigned n_threads = 0);
+Digest image_digest(PortableExecutable const &, DigestMode = DigestMode::whole_file, unsigned n_threads = 0);
+Digest image_digest(MappedImage const &, DigestMode = DigestMode::whole_file, unsigned n_threads = 0);
+
+// Write a file with write_pe_file, and compute its digest while writing it.
+Digest write_pe_file_with_digest(char const * file_name, PortableExecutable const &, DigestMode = DigestMode::whole_file);
+
+}
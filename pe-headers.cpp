@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "pe-bytes.hpp"
+#include "pe-headers.hpp"
+
+namespace PE {
+
+ImageHeaders::ImageHeaders(mstd::range<unsigned char const> headers) try : headers_(headers) {
+	using namespace layout;
+
+	auto data = headers.subrange(DosHeader::pe_header_offset::offset);
+	pe_header_offset_ = read_uint32(data, 1);
+
+	data = headers.subrange(pe_header_offset_);
+	if (read_uint32(data, 2) != CoffHeader::signature_value) throw 3;
+
+	uint16_t magic = headers.size() >= optional_header_offset() + OptionalHeader::magic::end ? this->magic() : 0;
+	if (magic == OptionalHeader::pe32_magic) {
+		pe32_plus_ = false;
+	} else if (magic == OptionalHeader::pe32_plus_magic) {
+		pe32_plus_ = true;
+	} else {
+		throw 4;
+	}
+
+	data_directories_offset_ = optional_header_offset() + (pe32_plus_ ? OptionalHeader64::data_directories : OptionalHeader32::data_directories);
+	if (headers.size() < data_directories_offset_) throw 5;
+
+	// Don't trust NumberOfRvaAndSizes to fit in the optional header, or in the headers.
+	size_t n = pe32_plus_ ? optional<OptionalHeader64::n_data_directories>() : optional<OptionalHeader32::n_data_directories>();
+	size_t optional_header_end = optional_header_offset() + optional_header_size();
+	if (optional_header_end < data_directories_offset_) throw 6;
+	n = std::min(n, (optional_header_end - data_directories_offset_) / layout::DataDirectory::entry_size);
+	n = std::min(n, (headers.size() - data_directories_offset_) / layout::DataDirectory::entry_size);
+	n_data_directories_ = n;
+} catch (int error) {
+	throw std::runtime_error("Unable to parse PE headers. (Error " + std::to_string(error) + ")");
+}
+
+uint64_t ImageHeaders::image_base() const {
+	if (!pe32_plus_) return optional<layout::OptionalHeader32::image_base>();
+	return optional<layout::OptionalHeader64::image_base>();
+}
+
+DataDirectory ImageHeaders::data_directory(size_t index) const {
+	if (index >= n_data_directories_) return {0, 0};
+	auto p = headers_.data() + data_directory_offset(index);
+	return {layout::DataDirectory::virtual_address::read(p), layout::DataDirectory::size::read(p)};
+}
+
+namespace layout {
+
+constexpr size_t DosHeader::size;
+constexpr uint16_t DosHeader::magic_value;
+constexpr size_t CoffHeader::size;
+constexpr uint32_t CoffHeader::signature_value;
+constexpr uint16_t OptionalHeader::pe32_magic;
+constexpr uint16_t OptionalHeader::pe32_plus_magic;
+constexpr size_t OptionalHeader32::data_directories;
+constexpr size_t OptionalHeader64::data_directories;
+constexpr size_t DataDirectory::entry_size;
+constexpr size_t SectionHeader::size;
+constexpr size_t ResourceDirectory::size;
+constexpr size_t ResourceDirectoryEntry::size;
+constexpr size_t ResourceDataEntry::size;
+constexpr size_t FixedFileInfo::size;
+constexpr uint32_t FixedFileInfo::signature_value;
+
+}
+
+constexpr size_t AddressMap::npos;
+
+AddressMap::AddressMap(PortableExecutable const & pe) {
+	intervals_.reserve(pe.sections.size());
+	// The same layout as write_pe_file.
+	size_t offset = pe.headers.size() + layout::SectionHeader::size * pe.sections.size();
+	for (auto const & s : pe.sections) {
+		offset = (offset + 511) & ~size_t(511);
+		mstd::range<unsigned char const> data(s.data.data(), s.data.size());
+		add(s.virtual_address, s.virtual_size, s.data.empty() ? npos : offset, data);
+		offset += (s.data.size() + 511) & ~size_t(511);
+	}
+	sort();
+}
+
+AddressMap::AddressMap(ImageView const & image) {
+	intervals_.reserve(image.sections.size());
+	for (auto const & s : image.sections) {
+		add(s.virtual_address, s.virtual_size, s.data.empty() ? npos : s.data_offset, s.data);
+	}
+	sort();
+}
+
+void AddressMap::add(uint32_t virtual_address, uint32_t virtual_size, size_t file_offset, mstd::range<unsigned char const> data) {
+	// Like the loader, use the size of the data if there is no virtual size.
+	if (virtual_size == 0) virtual_size = std::min<size_t>(data.size(), UINT32_MAX);
+	intervals_.push_back({virtual_address, virtual_size, intervals_.size(), file_offset, data});
+}
+
+void AddressMap::sort() {
+	std::stable_sort(intervals_.begin(), intervals_.end(), [] (Interval const & a, Interval const & b) {
+		return a.virtual_address < b.virtual_address;
+	});
+}
+
+AddressMap::Interval const * AddressMap::find(uint32_t rva) const {
+	auto i = std::upper_bound(intervals_.begin(), intervals_.end(), rva, [] (uint32_t rva, Interval const & s) {
+		return rva < s.virtual_address;
+	});
+	if (i == intervals_.begin()) return nullptr;
+	--i;
+	if (rva - i->virtual_address >= i->virtual_size) return nullptr;
+	return &*i;
+}
+
+size_t AddressMap::section(uint32_t rva) const {
+	auto i = find(rva);
+	return i ? i->section : npos;
+}
+
+size_t AddressMap::file_offset(uint32_t rva) const {
+	auto i = find(rva);
+	if (!i || rva - i->virtual_address >= i->data.size()) return npos;
+	return i->file_offset + (rva - i->virtual_address);
+}
+
+mstd::range<unsigned char const> AddressMap::data(uint32_t rva) const {
+	auto i = find(rva);
+	if (!i) return {};
+	return i->data.subrange(rva - i->virtual_address);
+}
+
+mstd::range<unsigned char const> AddressMap::data(uint32_t rva, size_t size) const {
+	auto d = data(rva);
+	if (d.size() < size) return {};
+	return d.subrange(0, size);
+}
+
+}
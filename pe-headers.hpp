@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe-layout.hpp"
+#include "pe.hpp"
+
+namespace PE {
+
+// The indices of the data directories in the optional header.
+enum DataDirectoryIndex : size_t {
+	export_directory          = 0,
+	import_directory          = 1,
+	resource_directory        = 2,
+	exception_directory       = 3,
+	security_directory        = 4,
+	base_relocation_directory = 5,
+	debug_directory           = 6,
+	architecture_directory    = 7,
+	global_pointer_directory  = 8,
+	tls_directory             = 9,
+	load_config_directory     = 10,
+	bound_import_directory    = 11,
+	import_address_directory  = 12,
+	delay_import_directory    = 13,
+	clr_runtime_directory     = 14,
+};
+
+struct DataDirectory {
+	uint32_t virtual_address;
+	uint32_t size;
+};
+
+// The COFF file header and the optional header of a PE file, for both PE32
+// and PE32+.
+//
+// Only the location of the headers is determined up front. The fields are
+// read from the header bytes when asked for, which must outlive this object.
+class ImageHeaders {
+public:
+	// Throws if the headers are truncated, or of an unknown format.
+	explicit ImageHeaders(mstd::range<unsigned char const> headers);
+
+	mstd::range<unsigned char const> bytes() const { return headers_; }
+
+	uint32_t pe_header_offset() const { return pe_header_offset_; }
+	bool is_pe32_plus() const { return pe32_plus_; }
+
+	// COFF file header.
+	uint16_t machine()              const { return coff<layout::CoffHeader::machine>(); }
+	uint16_t n_sections()           const { return coff<layout::CoffHeader::n_sections>(); }
+	uint32_t time_date_stamp()      const { return coff<layout::CoffHeader::time_date_stamp>(); }
+	uint16_t optional_header_size() const { return coff<layout::CoffHeader::optional_header_size>(); }
+	uint16_t characteristics()      const { return coff<layout::CoffHeader::characteristics>(); }
+
+	// Optional header.
+	uint16_t magic()               const { return optional<layout::OptionalHeader::magic>(); }
+	uint32_t size_of_code()        const { return optional<layout::OptionalHeader::size_of_code>(); }
+	uint32_t entry_point()         const { return optional<layout::OptionalHeader::entry_point>(); }
+	uint64_t image_base()          const;
+	uint32_t section_alignment()   const { return optional<layout::OptionalHeader::section_alignment>(); }
+	uint32_t file_alignment()      const { return optional<layout::OptionalHeader::file_alignment>(); }
+	uint32_t size_of_image()       const { return optional<layout::OptionalHeader::size_of_image>(); }
+	uint32_t size_of_headers()     const { return optional<layout::OptionalHeader::size_of_headers>(); }
+	uint32_t checksum()            const { return optional<layout::OptionalHeader::checksum>(); }
+	uint16_t subsystem()           const { return optional<layout::OptionalHeader::subsystem>(); }
+	uint16_t dll_characteristics() const { return optional<layout::OptionalHeader::dll_characteristics>(); }
+
+	// The number of data directories that are actually present.
+	size_t n_data_directories() const { return n_data_directories_; }
+
+	// A zero DataDirectory if it's not present.
+	DataDirectory data_directory(size_t index) const;
+
+	// The offset of the fields in the headers, for patching them.
+	size_t optional_header_offset() const { return pe_header_offset_ + layout::CoffHeader::size; }
+	size_t checksum_offset() const { return optional_header_offset() + layout::OptionalHeader::checksum::offset; }
+	size_t size_of_image_offset() const { return optional_header_offset() + layout::OptionalHeader::size_of_image::offset; }
+	size_t data_directory_offset(size_t index) const {
+		return data_directories_offset_ + layout::DataDirectory::entry_size * index;
+	}
+
+private:
+	template<typename F> typename F::type coff() const {
+		return F::read(headers_.data() + pe_header_offset_);
+	}
+	template<typename F> typename F::type optional() const {
+		return F::read(headers_.data() + optional_header_offset());
+	}
+
+	mstd::range<unsigned char const> headers_;
+	uint32_t pe_header_offset_ = 0;
+	uint32_t data_directories_offset_ = 0;
+	size_t n_data_directories_ = 0;
+	bool pe32_plus_ = false;
+};
+
+// Translates relative virtual addresses (RVAs) to sections and file offsets.
+//
+// The sections are kept as intervals sorted by virtual address, so every
+// lookup is a binary search instead of a scan over all sections.
+class AddressMap {
+public:
+	static constexpr size_t npos = size_t(-1);
+
+	AddressMap() {}
+
+	// File offsets are where write_pe_file would put the data.
+	explicit AddressMap(PortableExecutable const &);
+
+	// File offsets are those in the image.
+	explicit AddressMap(ImageView const &);
+
+	// The index of the section containing the RVA, or npos.
+	size_t section(uint32_t rva) const;
+
+	// The file offset of the RVA, or npos if it's not backed by section data.
+	size_t file_offset(uint32_t rva) const;
+
+	// The section data from the RVA to the end of its section. Empty if the
+	// RVA is not backed by section data.
+	mstd::range<unsigned char const> data(uint32_t rva) const;
+
+	// Exactly size bytes at the RVA, or an empty range if the section data
+	// ends before that.
+	mstd::range<unsigned char const> data(uint32_t rva, size_t size) const;
+
+	// The contents of a data directory.
+	mstd::range<unsigned char const> data(DataDirectory d) const { return data(d.virtual_address, d.size); }
+
+private:
+	struct Interval {
+		uint32_t virtual_address;
+		uint32_t virtual_size;
+		size_t section;
+		size_t file_offset;
+		mstd::range<unsigned char const> data;
+	};
+
+	void add(uint32_t virtual_address, uint32_t virtual_size, size_t file_offset, mstd::range<unsigned char const> data);
+	void sort();
+	Interval const * find(uint32_t rva) const;
+
+	std::vector<Interval> intervals_;
+};
+
+}
@@ -0,0 +1,614 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__) && !defined(PE_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+#include "pe-budget.hpp"
+#include "pe-ingest.hpp"
+#include "pe-layout.hpp"
+#include "pe-stream.hpp"
+
+namespace PE {
+
+#ifndef WIN32
+
+namespace {
+
+// The first read of a file, which is enough for the headers of most files.
+size_t const initial_header_read = 4096;
+
+struct File;
+
+// A read of part of a file. It can complete with fewer bytes than requested,
+// in which case the rest is read with the same Read.
+struct Read {
+	File * file;
+	iovec iov;
+	uint64_t offset;
+	long result; // The number of bytes read, or -errno.
+	size_t section = 0; // For the reads of the sections.
+};
+
+struct File {
+	int fd = -1;
+	uint64_t size = 0;
+	size_t budget = 0;
+
+	std::vector<unsigned char> head;
+	Read head_read;
+	bool headers_parsed = false;
+
+	std::vector<std::vector<unsigned char>> data; // Per section.
+	std::vector<Read> reads; // Of the sections, which have no buffer until they're issued.
+	uint64_t sections_size = 0; // The total size of the reads.
+	size_t wanted = 0; // While waiting for the budget: how much the next reads need.
+	size_t reads_left = 0;
+
+	IngestResult result;
+};
+
+// Reads files, with several reads in flight.
+class IoQueue {
+public:
+	virtual ~IoQueue() {}
+
+	// Start a read. The caller makes sure no more than the queue depth are
+	// submitted but not yet returned by wait().
+	virtual void submit(Read *) = 0;
+
+	// Wait for a read to complete. Only if there are any in flight.
+	virtual Read * wait() = 0;
+};
+
+class ThreadPoolQueue : public IoQueue {
+public:
+	explicit ThreadPoolQueue(unsigned n_threads) {
+		threads_.reserve(n_threads);
+		for (unsigned i = 0; i < n_threads; ++i) threads_.emplace_back([this] { work(); });
+	}
+
+	~ThreadPoolQueue() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		submitted_.notify_all();
+		for (auto & t : threads_) t.join();
+	}
+
+	void submit(Read * read) override {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			pending_.push_back(read);
+		}
+		submitted_.notify_one();
+	}
+
+	Read * wait() override {
+		std::unique_lock<std::mutex> lock(mutex_);
+		completed_.wait(lock, [&] { return !done_.empty(); });
+		Read * read = done_.front();
+		done_.pop_front();
+		return read;
+	}
+
+private:
+	void work() {
+		while (true) {
+			Read * read;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				submitted_.wait(lock, [&] { return stop_ || !pending_.empty(); });
+				if (pending_.empty()) return;
+				read = pending_.front();
+				pending_.pop_front();
+			}
+			ssize_t n;
+			do {
+				n = pread(read->file->fd, read->iov.iov_base, read->iov.iov_len, read->offset);
+			} while (n < 0 && errno == EINTR);
+			read->result = n < 0 ? -errno : n;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				done_.push_back(read);
+			}
+			completed_.notify_one();
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable submitted_;
+	std::condition_variable completed_;
+	std::deque<Read *> pending_;
+	std::deque<Read *> done_;
+	bool stop_ = false;
+	std::vector<std::thread> threads_;
+};
+
+#ifdef PE_HAVE_IO_URING
+
+// io_uring through the system calls directly, since liburing isn't always
+// available. Uses IORING_OP_READV, which is supported since Linux 5.1.
+class IoUring : public IoQueue {
+public:
+	// Throws if io_uring isn't available.
+	explicit IoUring(unsigned entries) {
+		io_uring_params p;
+		std::memset(&p, 0, sizeof(p));
+		fd_ = syscall(__NR_io_uring_setup, entries, &p);
+		if (fd_ < 0) throw std::runtime_error("Unable to set up io_uring.");
+
+		sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+		sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+
+		sq_ = map(sq_size_, IORING_OFF_SQ_RING);
+		cq_ = single_mmap ? sq_ : map(cq_size_, IORING_OFF_CQ_RING);
+		void * sqes = map(sqes_size_, IORING_OFF_SQES);
+		if (!sq_ || !cq_ || !sqes) {
+			release();
+			throw std::runtime_error("Unable to set up io_uring.");
+		}
+
+		auto sq = static_cast<unsigned char *>(sq_);
+		auto cq = static_cast<unsigned char *>(cq_);
+		sq_tail_  = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+		sq_mask_  = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+		sqes_     = static_cast<io_uring_sqe *>(sqes);
+		cq_head_  = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+		cq_tail_  = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+		cq_mask_  = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+		cqes_     = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+	}
+
+	~IoUring() {
+		release();
+	}
+
+	void submit(Read * read) override {
+		// Only this thread writes the tail.
+		unsigned tail = *sq_tail_;
+		unsigned i = tail & sq_mask_;
+		io_uring_sqe & sqe = sqes_[i];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode    = IORING_OP_READV;
+		sqe.fd        = read->file->fd;
+		sqe.addr      = reinterpret_cast<uintptr_t>(&read->iov);
+		sqe.len       = 1;
+		sqe.off       = read->offset;
+		sqe.user_data = reinterpret_cast<uintptr_t>(read);
+		sq_array_[i] = i;
+		__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+		++unsubmitted_;
+	}
+
+	Read * wait() override {
+		while (true) {
+			unsigned head = *cq_head_;
+			if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+				io_uring_cqe const & cqe = cqes_[head & cq_mask_];
+				Read * read = reinterpret_cast<Read *>(uintptr_t(cqe.user_data));
+				read->result = cqe.res;
+				__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+				return read;
+			}
+			// Submit everything that's queued, and wait for a completion.
+			long n = syscall(__NR_io_uring_enter, fd_, unsubmitted_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+				throw std::runtime_error("Unable to read from file.");
+			}
+			unsubmitted_ -= n;
+		}
+	}
+
+private:
+	void * map(size_t size, off_t offset) {
+		void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+		return p == MAP_FAILED ? nullptr : p;
+	}
+
+	void release() {
+		if (sqes_) munmap(sqes_, sqes_size_);
+		if (cq_ && cq_ != sq_) munmap(cq_, cq_size_);
+		if (sq_) munmap(sq_, sq_size_);
+		if (fd_ >= 0) close(fd_);
+	}
+
+	int fd_ = -1;
+	void * sq_ = nullptr;
+	void * cq_ = nullptr;
+	size_t sq_size_ = 0;
+	size_t cq_size_ = 0;
+	size_t sqes_size_ = 0;
+	unsigned * sq_tail_ = nullptr;
+	unsigned sq_mask_ = 0;
+	unsigned * sq_array_ = nullptr;
+	io_uring_sqe * sqes_ = nullptr;
+	unsigned * cq_head_ = nullptr;
+	unsigned * cq_tail_ = nullptr;
+	unsigned cq_mask_ = 0;
+	io_uring_cqe * cqes_ = nullptr;
+	unsigned unsubmitted_ = 0;
+};
+
+#endif
+
+// How much of the file is needed for the headers and the section table, as
+// far as can be told from what was read of it so far.
+uint64_t headers_needed(std::vector<unsigned char> const & head) {
+	using Dos = layout::DosHeader;
+	using Coff = layout::CoffHeader;
+	using Sec = layout::SectionHeader;
+	if (head.size() < Dos::size) return Dos::size;
+	uint64_t pe_header_offset = Dos::pe_header_offset::read(head.data());
+	if (head.size() < pe_header_offset + Coff::size) return pe_header_offset + Coff::size;
+	auto coff = head.data() + pe_header_offset;
+	return pe_header_offset + Coff::size + Coff::optional_header_size::read(coff)
+		+ uint64_t(Sec::size) * Coff::n_sections::read(coff);
+}
+
+// Parse the headers and the section table from what was read of the file so
+// far, and prepare the reads of the sections. Returns false, with needed set
+// to how much of the file to read, if that wasn't enough. Throws if the
+// headers are invalid.
+bool parse_headers(File & f, uint64_t & needed) {
+	using Dos = layout::DosHeader;
+	// Same error as read_pe_image, without reading up to the offset first.
+	if (
+		f.head.size() >= Dos::size &&
+		Dos::magic::read(f.head.data()) == Dos::magic_value &&
+		Dos::pe_header_offset::read(f.head.data()) > f.size
+	) {
+		throw std::runtime_error("Unable to parse PE file. (Error 5)");
+	}
+
+	size_t position = 0;
+	bool exhausted = false;
+	auto source = [&] (unsigned char * buffer, size_t size) {
+		size_t n = std::min(size, f.head.size() - position);
+		std::memcpy(buffer, f.head.data() + position, n);
+		position += n;
+		if (n == 0) exhausted = true;
+		return n;
+	};
+
+	try {
+		StreamReader reader(source, initial_header_read);
+
+		auto & pe = f.result.pe;
+		pe.headers = reader.headers();
+		pe.sections.resize(reader.sections().size());
+		f.data.resize(reader.sections().size());
+		f.reads.reserve(reader.sections().size());
+		for (size_t i = 0; i < pe.sections.size(); ++i) {
+			auto const & s = reader.sections()[i];
+			auto & section = pe.sections[i];
+			section.name            = s.name;
+			section.virtual_size    = s.virtual_size;
+			section.virtual_address = s.virtual_address;
+			section.characteristics = s.characteristics;
+			if (s.data_size == 0) continue;
+			// Same errors as read_pe_image.
+			if (s.data_offset > f.size) throw std::runtime_error("Unable to parse PE file. (Error 24)");
+			if (s.data_offset + uint64_t(s.data_size) > f.size) throw std::runtime_error("Unable to parse PE file. (Error 25)");
+			f.reads.push_back(Read{&f, {nullptr, s.data_size}, s.data_offset, 0, i});
+			f.sections_size += s.data_size;
+		}
+	} catch (std::runtime_error const &) {
+		if (!exhausted) throw;
+		// Reading beyond the end of the file wouldn't change the error.
+		needed = std::min(headers_needed(f.head), f.size);
+		if (needed <= f.head.size()) throw;
+		return false;
+	}
+
+	f.headers_parsed = true;
+	return true;
+}
+
+}
+
+bool io_uring_available() {
+#ifdef PE_HAVE_IO_URING
+	try {
+		IoUring ring(1);
+		return true;
+	} catch (std::runtime_error const &) {
+	}
+#endif
+	return false;
+}
+
+void ingest_pe_files(
+	std::vector<std::string> const & file_names,
+	std::function<void (IngestResult &)> const & consume,
+	IngestOptions const & options
+) {
+	unsigned const depth = std::max(1u, options.queue_depth);
+
+	std::vector<std::unique_ptr<File>> files(file_names.size());
+
+	std::unique_ptr<IoQueue> io;
+#ifdef PE_HAVE_IO_URING
+	if (options.use_io_uring) {
+		try {
+			io = std::make_unique<IoUring>(depth);
+		} catch (std::runtime_error const &) {
+			// Not supported by the kernel, or not allowed.
+		}
+	}
+#endif
+	if (!io) io = std::make_unique<ThreadPoolQueue>(depth);
+
+	ByteBudget budget(options.max_bytes_in_flight);
+
+	// The files that were read, waiting for the consumers.
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::unique_ptr<File>> ready;
+	bool done = false;
+	std::exception_ptr failure;
+	std::atomic<bool> failed{false};
+
+	auto consumer = [&] {
+		while (true) {
+			std::unique_ptr<File> f;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return done || !ready.empty(); });
+				if (ready.empty()) return;
+				f = std::move(ready.front());
+				ready.pop_front();
+			}
+			if (!failed) {
+				try {
+					consume(f->result);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!failure) failure = std::current_exception();
+					failed = true;
+				}
+			}
+			size_t size = f->budget;
+			f.reset();
+			budget.release(size);
+		}
+	};
+
+	size_t n_threads = options.n_threads;
+	if (n_threads == 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+	n_threads = std::max<size_t>(1, std::min(n_threads, file_names.size()));
+	std::vector<std::thread> consumers;
+	consumers.reserve(n_threads);
+	for (size_t i = 0; i < n_threads; ++i) consumers.emplace_back(consumer);
+
+	auto finish = [&] (File & f) {
+		if (f.fd >= 0) close(f.fd);
+		f.fd = -1;
+		if (f.result.error.empty()) {
+			f.result.ok = true;
+			for (size_t i = 0; i < f.data.size(); ++i) {
+				f.result.pe.sections[i].data = std::move(f.data[i]);
+			}
+		} else {
+			f.result.pe = PortableExecutable();
+		}
+		f.data.clear();
+		f.reads.clear();
+		f.head.clear();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.push_back(std::move(files[f.result.index]));
+		}
+		cv.notify_one();
+	};
+
+	// Reads that are waiting for room in the queue.
+	std::deque<Read *> waiting;
+	size_t in_flight = 0;
+	auto issue = [&] (Read * read) {
+		if (in_flight < depth) {
+			io->submit(read);
+			++in_flight;
+		} else {
+			waiting.push_back(read);
+		}
+	};
+
+	// Read (the rest of) the first size bytes of a file into its head.
+	auto read_head = [&] (File & f, size_t size) {
+		size_t old_size = f.head.size();
+		f.head.resize(size);
+		f.head_read = Read{&f, {f.head.data() + old_size, size - old_size}, old_size, 0};
+		f.reads_left = 1;
+		issue(&f.head_read);
+	};
+
+	// Allocate the data of the sections and start reading them.
+	auto read_sections = [&] (File & f) {
+		for (auto & r : f.reads) {
+			auto & data = f.data[r.section];
+			data.resize(r.iov.iov_len);
+			r.iov.iov_base = data.data();
+		}
+		f.reads_left = f.reads.size();
+		for (auto & r : f.reads) issue(&r);
+	};
+
+	// Files waiting for room in the budget for their next reads, in order.
+	// They give back what they hold while they wait, so that with no reads
+	// in flight, only the consumers hold any of the budget.
+	std::deque<File *> blocked;
+
+	// Charge n more bytes to a file, or make it wait for room for size bytes,
+	// after which its next reads start over.
+	auto charge = [&] (File & f, size_t n, size_t size) {
+		if (budget.try_acquire(n)) {
+			f.budget += n;
+			return true;
+		}
+		budget.release(f.budget);
+		f.budget = 0;
+		std::vector<unsigned char>().swap(f.head);
+		f.wanted = size;
+		blocked.push_back(&f);
+		return false;
+	};
+
+	// Start reading the headers of a file. Returns false if they don't fit in
+	// the budget while other files are in flight. The sections are only
+	// charged once the headers are valid.
+	auto start = [&] (size_t index) {
+		auto & f = files[index];
+		f = std::make_unique<File>();
+		f->result.index = index;
+		struct stat s;
+		char const * name = file_names[index].c_str();
+		if (stat(name, &s) != 0) {
+			f->result.error = "Unable to open file.";
+			finish(*f);
+			return true;
+		}
+		f->size = s.st_size;
+		size_t head_size = std::min<uint64_t>(f->size, initial_header_read);
+		if (!budget.try_acquire(head_size)) {
+			if (in_flight > 0) {
+				f.reset();
+				return false;
+			}
+			budget.acquire(head_size);
+		}
+		f->budget = head_size;
+		f->fd = open(name, O_RDONLY | O_CLOEXEC);
+		if (f->fd < 0) {
+			f->result.error = "Unable to open file.";
+			finish(*f);
+			return true;
+		}
+		read_head(*f, head_size);
+		return true;
+	};
+
+	// A read completed entirely (or failed).
+	auto complete = [&] (Read * read) {
+		File & f = *read->file;
+		if (--f.reads_left > 0) return;
+		if (!f.result.error.empty() || f.headers_parsed) {
+			finish(f);
+			return;
+		}
+		try {
+			uint64_t needed;
+			if (!parse_headers(f, needed)) {
+				if (charge(f, needed - f.head.size(), needed)) read_head(f, needed);
+				return;
+			}
+		} catch (std::exception const & e) {
+			f.result.error = e.what();
+			finish(f);
+			return;
+		}
+		// The headers were copied into the result.
+		std::vector<unsigned char>().swap(f.head);
+		budget.release(f.budget);
+		f.budget = 0;
+		if (f.reads.empty()) {
+			finish(f);
+			return;
+		}
+		if (charge(f, f.sections_size, f.sections_size)) read_sections(f);
+	};
+
+	try {
+		size_t next = 0;
+		while (true) {
+			// Files waiting for the budget go first, and hold up new ones. With
+			// no reads in flight, waiting for the consumers can't deadlock.
+			while (!blocked.empty()) {
+				File & f = *blocked.front();
+				if (!budget.try_acquire(f.wanted)) {
+					if (in_flight > 0) break;
+					budget.acquire(f.wanted);
+				}
+				f.budget = f.wanted;
+				blocked.pop_front();
+				if (f.headers_parsed) read_sections(f);
+				else read_head(f, f.wanted);
+			}
+			while (blocked.empty() && next < file_names.size() && !failed && in_flight < depth && start(next)) ++next;
+			if (in_flight == 0) break;
+
+			Read * read = io->wait();
+			--in_flight;
+			if (!waiting.empty()) {
+				io->submit(waiting.front());
+				waiting.pop_front();
+				++in_flight;
+			}
+
+			File & f = *read->file;
+			if (read->result < 0) {
+				f.result.error = "Unable to read from file.";
+			} else if (read->result == 0 && read->iov.iov_len > 0) {
+				// The file got shorter.
+				f.result.error = "Unable to read from file.";
+			} else if (size_t(read->result) < read->iov.iov_len) {
+				read->iov.iov_base = static_cast<unsigned char *>(read->iov.iov_base) + read->result;
+				read->iov.iov_len -= read->result;
+				read->offset += read->result;
+				issue(read);
+				continue;
+			}
+			complete(read);
+		}
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+		}
+		cv.notify_all();
+		for (auto & t : consumers) t.join();
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+	}
+	cv.notify_all();
+	for (auto & t : consumers) t.join();
+
+	if (failure) std::rethrow_exception(failure);
+}
+
+#endif
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "pe.hpp"
+
+namespace PE {
+
+#ifndef WIN32
+
+struct IngestOptions {
+	// The maximum number of reads in flight at once.
+	unsigned queue_depth = 64;
+
+	// The maximum total size of the files being read, or waiting for or being
+	// processed by the consumer. Only the headers of a file count until
+	// they're valid, and then only its sections. A file larger than this is
+	// read alone.
+	size_t max_bytes_in_flight = size_t(256) << 20;
+
+	// The number of threads that run the consumer. Zero means one per core.
+	unsigned n_threads = 0;
+
+	// Use io_uring where the system supports it. Otherwise, or if it's not
+	// available, the reads are done by a pool of queue_depth threads.
+	bool use_io_uring = true;
+};
+
+struct IngestResult {
+	size_t index; // In the list of file names.
+	bool ok = false;
+	std::string error; // Only set if !ok.
+	PortableExecutable pe; // Only set if ok.
+};
+
+// Read many PE files with many reads in flight at once, and pass each of them
+// to consume as soon as it's read.
+//
+// Every file is read in two steps: first its headers, and then, only if the
+// headers are valid, all of its sections at once. The reads of different
+// files overlap. consume runs on separate threads, so the reading continues
+// while it runs. It's called exactly once for every file, in any order, also
+// for files that couldn't be read. It may move the PortableExecutable out of
+// the result.
+//
+// If consume throws, no more files are read, and the exception is rethrown
+// once all running consumers are done.
+void ingest_pe_files(
+	std::vector<std::string> const & file_names,
+	std::function<void (IngestResult &)> const & consume,
+	IngestOptions const & options = IngestOptions()
+);
+
+// Whether ingest_pe_files can use io_uring on this system.
+bool io_uring_available();
+
+#endif
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// Internal instrumentation macros. Not part of the public interface.
+//
+// PE_STAGE(stage) measures the rest of the enclosing scope as a Stage, and
+// PE_COUNT(field, n) adds n to a field of the StageStats of the innermost
+// stage that's running on this thread, if any, which adds it to the stage
+// around it when it ends. A stage that's already running isn't measured
+// again when entered recursively.
+//
+// Without PE_INSTRUMENTATION, both expand to nothing.
+
+#include "pe-stats.hpp"
+
+#ifdef PE_INSTRUMENTATION
+
+#include <chrono>
+
+namespace PE {
+
+class StageScope {
+public:
+	explicit StageScope(Stage);
+	~StageScope();
+
+	StageScope(StageScope const &) = delete;
+	StageScope & operator = (StageScope const &) = delete;
+
+	StageStats stats;
+
+private:
+	Stage stage_;
+	bool active_;
+	StageScope * outer_;
+	uint64_t allocations_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+// The innermost running stage of this thread, or null.
+extern thread_local StageScope * current_stage;
+
+}
+
+#define PE_STAGE(stage) ::PE::StageScope pe_stage_scope_(::PE::Stage::stage)
+#define PE_COUNT(field, n) do { \
+	if (::PE::StageScope * pe_stage_ = ::PE::current_stage) pe_stage_->stats.field += (n); \
+} while (0)
+
+#else
+
+#define PE_STAGE(stage) do {} while (0)
+#define PE_COUNT(field, n) do {} while (0)
+
+#endif
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// The layouts of the structures in PE files: the offset and type of every
+// field that's used, in one place.
+//
+// Fields are read and written with load_le and store_le, which compile to a
+// single (unaligned) load or store, with a byte swap only on big-endian hosts.
+
+namespace PE {
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+inline uint8_t  byte_swap(uint8_t  x) { return x; }
+inline uint16_t byte_swap(uint16_t x) { return __builtin_bswap16(x); }
+inline uint32_t byte_swap(uint32_t x) { return __builtin_bswap32(x); }
+inline uint64_t byte_swap(uint64_t x) { return __builtin_bswap64(x); }
+#endif
+
+template<typename T>
+inline T load_le(unsigned char const * p) {
+	T value;
+	std::memcpy(&value, p, sizeof(T));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = byte_swap(value);
+#endif
+	return value;
+}
+
+template<typename T>
+inline void store_le(unsigned char * p, T value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = byte_swap(value);
+#endif
+	std::memcpy(p, &value, sizeof(T));
+}
+
+// A little-endian integer of type T at a fixed offset in a structure.
+template<typename T, size_t Offset>
+struct Field {
+	using type = T;
+	static constexpr size_t offset = Offset;
+	static constexpr size_t end = Offset + sizeof(T);
+
+	static T read(unsigned char const * structure) { return load_le<T>(structure + Offset); }
+	static void write(unsigned char * structure, T value) { store_le<T>(structure + Offset, value); }
+};
+
+template<typename T, size_t Offset> constexpr size_t Field<T, Offset>::offset;
+template<typename T, size_t Offset> constexpr size_t Field<T, Offset>::end;
+
+// Size bytes at a fixed offset in a structure.
+template<size_t Offset, size_t Size>
+struct Bytes {
+	static constexpr size_t offset = Offset;
+	static constexpr size_t size = Size;
+	static constexpr size_t end = Offset + Size;
+};
+
+template<size_t Offset, size_t Size> constexpr size_t Bytes<Offset, Size>::offset;
+template<size_t Offset, size_t Size> constexpr size_t Bytes<Offset, Size>::size;
+template<size_t Offset, size_t Size> constexpr size_t Bytes<Offset, Size>::end;
+
+namespace layout {
+
+// The start of the MS-DOS header, at the start of the file.
+struct DosHeader {
+	using magic            = Field<uint16_t, 0x00>; // "MZ"
+	using pe_header_offset = Field<uint32_t, 0x3C>;
+	static constexpr size_t size = 0x40;
+	static constexpr uint16_t magic_value = 0x5A4D;
+};
+
+// The PE signature followed by the COFF file header, at pe_header_offset.
+struct CoffHeader {
+	using signature            = Field<uint32_t, 0x00>; // "PE\0\0"
+	using machine              = Field<uint16_t, 0x04>;
+	using n_sections           = Field<uint16_t, 0x06>;
+	using time_date_stamp      = Field<uint32_t, 0x08>;
+	using symbol_table_offset  = Field<uint32_t, 0x0C>;
+	using n_symbols            = Field<uint32_t, 0x10>;
+	using optional_header_size = Field<uint16_t, 0x14>;
+	using characteristics      = Field<uint16_t, 0x16>;
+	static constexpr size_t size = 0x18;
+	static constexpr uint32_t signature_value = 0x00004550;
+};
+
+// The optional header, right after the CoffHeader. These fields are at the
+// same offsets in PE32 and PE32+.
+struct OptionalHeader {
+	using magic               = Field<uint16_t, 0x00>;
+	using size_of_code        = Field<uint32_t, 0x04>;
+	using entry_point         = Field<uint32_t, 0x10>;
+	using section_alignment   = Field<uint32_t, 0x20>;
+	using file_alignment      = Field<uint32_t, 0x24>;
+	using size_of_image       = Field<uint32_t, 0x38>;
+	using size_of_headers     = Field<uint32_t, 0x3C>;
+	using checksum            = Field<uint32_t, 0x40>;
+	using subsystem           = Field<uint16_t, 0x44>;
+	using dll_characteristics = Field<uint16_t, 0x46>;
+	static constexpr uint16_t pe32_magic = 0x10B;
+	static constexpr uint16_t pe32_plus_magic = 0x20B;
+};
+
+struct OptionalHeader32 : OptionalHeader {
+	using image_base         = Field<uint32_t, 0x1C>;
+	using n_data_directories = Field<uint32_t, 0x5C>;
+	static constexpr size_t data_directories = 0x60;
+};
+
+struct OptionalHeader64 : OptionalHeader {
+	using image_base         = Field<uint64_t, 0x18>;
+	using n_data_directories = Field<uint32_t, 0x6C>;
+	static constexpr size_t data_directories = 0x70;
+};
+
+// An entry in the data directories at the end of the optional header.
+struct DataDirectory {
+	using virtual_address = Field<uint32_t, 0x00>;
+	using size            = Field<uint32_t, 0x04>;
+	static constexpr size_t entry_size = 8;
+};
+
+// An entry in the section table, which follows the optional header.
+struct SectionHeader {
+	using name            = Bytes<0x00, 8>;
+	using virtual_size    = Field<uint32_t, 0x08>;
+	using virtual_address = Field<uint32_t, 0x0C>;
+	using data_size       = Field<uint32_t, 0x10>;
+	using data_offset     = Field<uint32_t, 0x14>;
+	using reloc_offset    = Field<uint32_t, 0x18>;
+	using lineno_offset   = Field<uint32_t, 0x1C>;
+	using n_reloc         = Field<uint16_t, 0x20>;
+	using n_lineno        = Field<uint16_t, 0x22>;
+	using characteristics = Field<uint32_t, 0x24>;
+	static constexpr size_t size = 0x28;
+};
+
+// A resource directory, followed by its entries.
+struct ResourceDirectory {
+	using characteristics = Field<uint32_t, 0x00>;
+	using time_date_stamp = Field<uint32_t, 0x04>;
+	using major_version   = Field<uint16_t, 0x08>;
+	using minor_version   = Field<uint16_t, 0x0A>;
+	using n_named_entries = Field<uint16_t, 0x0C>;
+	using n_id_entries    = Field<uint16_t, 0x0E>;
+	static constexpr size_t size = 0x10;
+};
+
+struct ResourceDirectoryEntry {
+	// A ResourceKey.
+	using key    = Field<uint32_t, 0x00>;
+	// The offset of a ResourceDirectory (with the high bit set) or a
+	// ResourceDataEntry in the resource section.
+	using target = Field<uint32_t, 0x04>;
+	static constexpr size_t size = 0x08;
+};
+
+struct ResourceDataEntry {
+	using data_rva  = Field<uint32_t, 0x00>;
+	using data_size = Field<uint32_t, 0x04>;
+	using code_page = Field<uint32_t, 0x08>;
+	using reserved  = Field<uint32_t, 0x0C>;
+	static constexpr size_t size = 0x10;
+};
+
+// VS_FIXEDFILEINFO. The versions and the date are read as single 64-bit
+// values, as in VersionInfo.
+struct FixedFileInfo {
+	using signature       = Field<uint32_t, 0x00>;
+	using struc_version   = Field<uint32_t, 0x04>;
+	using file_version    = Field<uint64_t, 0x08>;
+	using product_version = Field<uint64_t, 0x10>;
+	using file_flags_mask = Field<uint32_t, 0x18>;
+	using file_flags      = Field<uint32_t, 0x1C>;
+	using file_os         = Field<uint32_t, 0x20>;
+	using file_type       = Field<uint32_t, 0x24>;
+	using file_subtype    = Field<uint32_t, 0x28>;
+	using file_date       = Field<uint64_t, 0x2C>;
+	static constexpr size_t size = 0x34;
+	static constexpr uint32_t signature_value = 0xFEEF04BD;
+};
+
+}
+
+}
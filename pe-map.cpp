@@ -0,0 +1,150 @@
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <mstd/range.hpp>
+
+#include "pe-map.hpp"
+
+namespace PE {
+
+#ifdef WIN32
+
+namespace {
+
+void map_file(HANDLE file, unsigned char const * & data, size_t & size) {
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size)) {
+		CloseHandle(file);
+		throw std::runtime_error("Unable to map file.");
+	}
+	size = file_size.QuadPart;
+	if (size == 0) {
+		CloseHandle(file);
+		return;
+	}
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping) throw std::runtime_error("Unable to map file.");
+	void * p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!p) throw std::runtime_error("Unable to map file.");
+	data = static_cast<unsigned char const *>(p);
+}
+
+}
+
+MappedFile::MappedFile(char const * file_name) {
+	HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Unable to open file.");
+	map_file(file, data_, size_);
+}
+
+MappedFile::MappedFile(wchar_t const * file_name) {
+	HANDLE file = CreateFileW(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Unable to open file.");
+	map_file(file, data_, size_);
+}
+
+MappedFile::~MappedFile() {
+	if (data_) UnmapViewOfFile(data_);
+}
+
+#else
+
+MappedFile::MappedFile(char const * file_name) {
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) throw std::runtime_error("Unable to open file.");
+	struct stat s;
+	if (fstat(fd, &s) != 0) {
+		close(fd);
+		throw std::runtime_error("Unable to map file.");
+	}
+	size_ = s.st_size;
+	if (size_ > 0) {
+		void * p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Unable to map file.");
+		}
+		data_ = static_cast<unsigned char const *>(p);
+	}
+	fd_ = fd;
+}
+
+MappedFile::~MappedFile() {
+	if (data_) munmap(const_cast<unsigned char *>(data_), size_);
+	if (fd_ >= 0) close(fd_);
+}
+
+#endif
+
+MappedFile::MappedFile(MappedFile && other) noexcept
+	: data_(other.data_), size_(other.size_), fd_(other.fd_) {
+	other.data_ = nullptr;
+	other.size_ = 0;
+	other.fd_ = -1;
+}
+
+MappedFile & MappedFile::operator = (MappedFile && other) noexcept {
+	std::swap(data_, other.data_);
+	std::swap(size_, other.size_);
+	std::swap(fd_, other.fd_);
+	return *this;
+}
+
+MappedImage::MappedImage(char const * file_name)
+	: MappedImage(MappedFile(file_name)) {}
+
+#ifdef WIN32
+MappedImage::MappedImage(wchar_t const * file_name)
+	: MappedImage(MappedFile(file_name)) {}
+#endif
+
+MappedImage::MappedImage(MappedFile file)
+	: file_(std::move(file)), image_(read_pe_image(file_.data())) {}
+
+PortableExecutable MappedImage::materialize() const {
+	return PE::materialize(image_);
+}
+
+PortableExecutable map_pe_file(char const * file_name) {
+	return map_pe_file(std::make_shared<MappedImage const>(file_name));
+}
+
+#ifdef WIN32
+PortableExecutable map_pe_file(wchar_t const * file_name) {
+	return map_pe_file(std::make_shared<MappedImage const>(file_name));
+}
+#endif
+
+PortableExecutable map_pe_file(std::shared_ptr<MappedImage const> image) {
+	PortableExecutable pe;
+	auto const & view = image->view();
+	pe.headers.assign(view.headers.begin(), view.headers.end());
+	pe.sections.resize(view.sections.size());
+	std::shared_ptr<MappedFile const> file(image, &image->file());
+	for (size_t i = 0; i < pe.sections.size(); ++i) {
+		auto const & s = view.sections[i];
+		auto & section = pe.sections[i];
+		section.name            = s.name;
+		section.virtual_size    = s.virtual_size;
+		section.virtual_address = s.virtual_address;
+		section.characteristics = s.characteristics;
+		section.data            = SectionData(s.data, file);
+	}
+	return pe;
+}
+
+}
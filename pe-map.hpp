@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe.hpp"
+
+namespace PE {
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+	MappedFile() {}
+	explicit MappedFile(char const * file_name);
+#ifdef WIN32
+	explicit MappedFile(wchar_t const * file_name);
+#endif
+
+	MappedFile(MappedFile &&) noexcept;
+	MappedFile & operator = (MappedFile &&) noexcept;
+	~MappedFile();
+
+	mstd::range<unsigned char const> data() const {
+		return {data_, size_};
+	}
+
+	// The open file descriptor of the mapped file, or -1 if there is none.
+	int file_descriptor() const {
+		return fd_;
+	}
+
+private:
+	unsigned char const * data_ = nullptr;
+	size_t size_ = 0;
+	int fd_ = -1;
+};
+
+// A PE file that is mapped into memory instead of read.
+//
+// The headers and the sections refer directly to the mapping, so opening an
+// image doesn't copy any section data. The views stay valid for as long as the
+// MappedImage exists (also when it's moved).
+class MappedImage {
+public:
+	explicit MappedImage(char const * file_name);
+#ifdef WIN32
+	explicit MappedImage(wchar_t const * file_name);
+#endif
+	explicit MappedImage(MappedFile);
+
+	mstd::range<unsigned char const> data() const {
+		return file_.data();
+	}
+
+	mstd::range<unsigned char const> headers() const {
+		return image_.headers;
+	}
+
+	std::vector<SectionView> const & sections() const {
+		return image_.sections;
+	}
+
+	ImageView const & view() const {
+		return image_;
+	}
+
+	MappedFile const & file() const {
+		return file_;
+	}
+
+	// Copy everything into a PortableExecutable, which owns its data.
+	PortableExecutable materialize() const;
+
+private:
+	MappedFile file_;
+	ImageView image_;
+};
+
+// Map a PE file into a PortableExecutable whose sections are views into the
+// mapping, instead of copies. The mapping stays alive for as long as any of
+// the sections refer to it.
+//
+// Sections are only copied when modified (see SectionData::edit), and
+// write_pe_file copies unmodified sections directly from the mapped file
+// where possible. Don't write the result to the file it was mapped from,
+// since the mapping would change while it's being written. Write it to a
+// new file instead, and rename that if needed.
+PortableExecutable map_pe_file(char const * file_name);
+#ifdef WIN32
+PortableExecutable map_pe_file(wchar_t const * file_name);
+#endif
+PortableExecutable map_pe_file(std::shared_ptr<MappedImage const>);
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+// The layout of the file write_pe_file writes, shared by the writers and by
+// the digests of an image. Not part of the public interface.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pe.hpp"
+
+namespace PE {
+
+// A piece of the output file.
+struct Chunk {
+	unsigned char const * data;
+	size_t size;
+	MappedFile const * source; // The file data refers to, if any.
+};
+
+// Everything write_pe_file writes, in order: the (patched) headers and
+// the section table, followed by the section data and its padding.
+//
+// The CheckSum field in head is left zero, to be filled in once the
+// checksum of all chunks is known.
+struct WritePlan {
+	std::vector<unsigned char> head;
+	std::vector<Chunk> chunks;
+	size_t size = 0;
+	size_t checksum_offset = 0;
+};
+
+WritePlan plan_pe_file(PortableExecutable const &);
+
+uint32_t checksum_of(std::vector<Chunk> const &);
+
+// Fill in the CheckSum field of the plan before writing it.
+void set_checksum(WritePlan &);
+
+}
@@ -0,0 +1,188 @@
+#include <cstring>
+
+#ifndef WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "pe-headers.hpp"
+#include "pe-layout.hpp"
+#include "pe-probe.hpp"
+
+namespace PE {
+
+namespace {
+
+// Like read_uint16 and read_uint32, but returning false instead of throwing.
+bool uint16_at(mstd::range<unsigned char const> data, size_t offset, uint16_t & value) {
+	if (offset > data.size() || data.size() - offset < 2) return false;
+	value = load_le<uint16_t>(data.data() + offset);
+	return true;
+}
+
+bool uint32_at(mstd::range<unsigned char const> data, size_t offset, uint32_t & value) {
+	if (offset > data.size() || data.size() - offset < 4) return false;
+	value = load_le<uint32_t>(data.data() + offset);
+	return true;
+}
+
+// Whether a root resource directory has an entry for the version
+// information. Unknown if it's not entirely in the given bytes.
+ProbeAnswer find_version_info(mstd::range<unsigned char const> directory) {
+	using D = layout::ResourceDirectory;
+	using E = layout::ResourceDirectoryEntry;
+	uint16_t n_named, n_ids;
+	if (
+		!uint16_at(directory, D::n_named_entries::offset, n_named) ||
+		!uint16_at(directory, D::n_id_entries::offset, n_ids)
+	) return ProbeAnswer::unknown;
+	for (size_t i = 0; i < n_ids; ++i) {
+		uint32_t id;
+		if (!uint32_at(directory, D::size + (size_t(n_named) + i) * E::size + E::key::offset, id)) return ProbeAnswer::unknown;
+		if (id == 16) return ProbeAnswer::yes;
+	}
+	return ProbeAnswer::no;
+}
+
+}
+
+ProbeResult probe(mstd::range<unsigned char const> data) {
+	using Dos = layout::DosHeader;
+	using Coff = layout::CoffHeader;
+	using Opt = layout::OptionalHeader;
+	using Dir = layout::DataDirectory;
+	using Sec = layout::SectionHeader;
+
+	ProbeResult result;
+
+	uint16_t mz;
+	if (!uint16_at(data, Dos::magic::offset, mz) || mz != Dos::magic_value) return result;
+
+	uint32_t pe_header_offset, signature;
+	uint16_t n_sections, optheader_size, magic;
+	if (
+		!uint32_at(data, Dos::pe_header_offset::offset, pe_header_offset) ||
+		!uint32_at(data, pe_header_offset + Coff::signature::offset, signature)
+	) {
+		result.status = ProbeStatus::truncated;
+		return result;
+	}
+	if (signature != Coff::signature_value) return result;
+
+	size_t optional_header = pe_header_offset + Coff::size;
+	if (
+		!uint16_at(data, pe_header_offset + Coff::machine::offset, result.machine) ||
+		!uint16_at(data, pe_header_offset + Coff::n_sections::offset, n_sections) ||
+		!uint16_at(data, pe_header_offset + Coff::optional_header_size::offset, optheader_size) ||
+		!uint16_at(data, optional_header + Opt::magic::offset, magic) ||
+		!uint32_at(data, optional_header + Opt::size_of_image::offset, result.size_of_image)
+	) {
+		result.status = ProbeStatus::truncated;
+		return result;
+	}
+	if (magic != Opt::pe32_magic && magic != Opt::pe32_plus_magic) return result;
+	result.pe32_plus = magic == Opt::pe32_plus_magic;
+	result.n_sections = n_sections;
+
+	// The same layout as in ImageHeaders.
+	size_t directories = optional_header + (result.pe32_plus
+		? layout::OptionalHeader64::data_directories
+		: layout::OptionalHeader32::data_directories);
+	size_t n_directories_offset = optional_header + (result.pe32_plus
+		? layout::OptionalHeader64::n_data_directories::offset
+		: layout::OptionalHeader32::n_data_directories::offset);
+	size_t section_table = optional_header + optheader_size;
+
+	uint32_t n_directories;
+	uint32_t resource_rva = 0, resource_size = 0;
+	if (!uint32_at(data, n_directories_offset, n_directories)) {
+		result.status = ProbeStatus::truncated;
+		return result;
+	}
+	size_t resource_entry = directories + Dir::entry_size * resource_directory;
+	if (n_directories > resource_directory && resource_entry + Dir::entry_size <= section_table) {
+		if (
+			!uint32_at(data, resource_entry + Dir::virtual_address::offset, resource_rva) ||
+			!uint32_at(data, resource_entry + Dir::size::offset, resource_size)
+		) {
+			result.status = ProbeStatus::truncated;
+			return result;
+		}
+	}
+
+	if (section_table > data.size() || (data.size() - section_table) / Sec::size < n_sections) {
+		result.status = ProbeStatus::truncated;
+		return result;
+	}
+	result.status = ProbeStatus::pe;
+
+	for (size_t i = 0; i < n_sections; ++i) {
+		// Entirely there, as checked above.
+		auto s = data.data() + section_table + i * Sec::size;
+		if (std::memcmp(s + Sec::name::offset, ".rsrc\0\0\0", Sec::name::size) == 0) result.has_resources = true;
+		if (resource_rva == 0) continue;
+		uint32_t virtual_address = Sec::virtual_address::read(s);
+		uint32_t raw_size = Sec::data_size::read(s);
+		uint32_t raw_offset = Sec::data_offset::read(s);
+		if (resource_rva >= virtual_address && resource_rva - virtual_address < raw_size) {
+			result.resource_directory_offset = raw_offset + (resource_rva - virtual_address);
+		}
+	}
+
+	if (resource_rva != 0 && resource_size != 0) result.has_resources = true;
+
+	if (result.resource_directory_offset) {
+		result.has_version_info = find_version_info(data.subrange(result.resource_directory_offset));
+	} else if (result.has_resources) {
+		result.has_version_info = ProbeAnswer::unknown;
+	}
+
+	return result;
+}
+
+#ifndef WIN32
+
+namespace {
+
+bool read_at(int fd, unsigned char * buffer, size_t size, off_t offset, size_t & n) {
+	ssize_t r;
+	do {
+		r = pread(fd, buffer, size, offset);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) return false;
+	n = r;
+	return true;
+}
+
+}
+
+ProbeResult probe(int fd) {
+	unsigned char buffer[probe_size];
+	size_t n;
+	if (!read_at(fd, buffer, sizeof(buffer), 0, n)) return ProbeResult();
+	ProbeResult result = probe({buffer, n});
+
+	if (result.has_version_info == ProbeAnswer::unknown && result.resource_directory_offset) {
+		// Enough for a root directory of 30 types, which is more than there
+		// usually are.
+		unsigned char directory[256];
+		if (read_at(fd, directory, sizeof(directory), result.resource_directory_offset, n)) {
+			result.has_version_info = find_version_info({directory, n});
+		}
+	}
+
+	return result;
+}
+
+ProbeResult probe(char const * file_name) {
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return ProbeResult();
+	ProbeResult result = probe(fd);
+	close(fd);
+	return result;
+}
+
+#endif
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <mstd/range.hpp>
+
+namespace PE {
+
+enum class ProbeStatus : uint8_t {
+	// Not a PE file.
+	not_pe,
+
+	// Starts like a PE file, but the headers don't fit in the given bytes.
+	truncated,
+
+	// The headers are complete.
+	pe,
+};
+
+enum class ProbeAnswer : uint8_t {
+	no,
+	yes,
+
+	// Not in the given bytes.
+	unknown,
+};
+
+// A summary of the headers of a (possible) PE file.
+struct ProbeResult {
+	ProbeStatus status = ProbeStatus::not_pe;
+	bool pe32_plus = false;
+	uint16_t machine = 0;
+	uint16_t n_sections = 0;
+	uint32_t size_of_image = 0;
+
+	// Whether there is a .rsrc section or a resource data directory.
+	bool has_resources = false;
+
+	// Whether the root resource directory has an entry for type 16.
+	ProbeAnswer has_version_info = ProbeAnswer::no;
+
+	// The file offset of the root resource directory, or 0 if it's unknown
+	// or there is none.
+	uint32_t resource_directory_offset = 0;
+
+	explicit operator bool () const { return status == ProbeStatus::pe; }
+};
+
+// Quickly check whether the first bytes of a file are the headers of a PE
+// file, without throwing or allocating anything.
+//
+// Only the headers, the section table and the root resource directory are
+// looked at, as far as they're in the given bytes. This is much less than
+// read_pe_file checks, so a file that passes can still fail to be read.
+ProbeResult probe(mstd::range<unsigned char const> first_bytes);
+
+#ifndef WIN32
+// The number of bytes probe reads from a file.
+constexpr size_t probe_size = 4096;
+
+// Probe a file with a single read of its first probe_size bytes, and, only if
+// the root resource directory isn't in those bytes, a second small read of
+// that. Gives status not_pe if the file can't be read.
+ProbeResult probe(int file_descriptor);
+ProbeResult probe(char const * file_name);
+#endif
+
+}
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iterator>
 #include <map>
 #include <memory>
@@ -11,113 +14,487 @@
 
 #include <mstd/range.hpp>
 
+#include "pe-bytes.hpp"
+#include "pe-instrument.hpp"
 #include "pe-res.hpp"
+#include "pe-utf.hpp"
 
 namespace PE {
 
 namespace {
 
-mstd::range<unsigned char const> read_data(mstd::range<unsigned char const> & data, size_t n_bytes, int error) {
-	if (data.size() < n_bytes) throw error;
-	auto d = data.subrange(0, n_bytes);
-	data.remove_prefix(n_bytes);
-	return d;
+// The checks of ResourceDirectory and its entries, which ResourceWalk shares.
+// Instead of throwing, they return the error number, or 0, and set
+// error_offset to where the problem was found.
+
+// Check that the header and entries of a directory are complete.
+int check_directory(mstd::range<unsigned char const> section, size_t offset, size_t & error_offset) {
+	using D = layout::ResourceDirectory;
+	using E = layout::ResourceDirectoryEntry;
+	auto data = section.subrange(offset);
+	error_offset = offset;
+	if (data.size() < D::n_named_entries::offset) return 1;
+	error_offset = offset + D::n_named_entries::offset;
+	if (data.size() < D::n_named_entries::end) return 1;
+	error_offset = offset + D::n_id_entries::offset;
+	if (data.size() < D::n_id_entries::end) return 2;
+	size_t n_entries = size_t(D::n_named_entries::read(data.data())) + D::n_id_entries::read(data.data());
+	error_offset = offset + D::size;
+	if ((data.size() - D::size) / E::size < n_entries) return 3;
+	return 0;
 }
 
-uint32_t read_uint32(mstd::range<unsigned char const> & data, int error) {
-	auto buf = read_data(data, 4, error);
-	return buf[0] | buf[1] << 8 | buf[2] << 16 | buf[3] << 24;
+// Check that a name in the resource section is complete.
+int check_name(mstd::range<unsigned char const> section, size_t offset, size_t & error_offset) {
+	auto name = section.subrange(offset);
+	error_offset = offset;
+	if (name.size() < 2) return 100;
+	error_offset = offset + 2;
+	if (name.size() - 2 < size_t(load_le<uint16_t>(name.data())) * 2) return 101;
+	return 0;
 }
 
-uint32_t read_uint16(mstd::range<unsigned char const> & data, int error) {
-	auto buf = read_data(data, 2, error);
-	return buf[0] | buf[1] << 8;
+// Check the data entry at offset, and the data it refers to.
+int check_data_entry(
+	mstd::range<unsigned char const> section,
+	uint32_t section_virtual_address,
+	size_t offset,
+	mstd::range<unsigned char const> & data,
+	size_t & error_offset
+) {
+	using R = layout::ResourceDataEntry;
+	auto r = section.subrange(offset, R::size);
+	error_offset = offset;
+	if (r.size() < R::data_rva::end) return 5;
+	error_offset = offset + R::data_size::offset;
+	if (r.size() < R::data_size::end) return 6;
+	error_offset = offset + R::code_page::offset;
+	if (r.size() < R::code_page::end) return 7;
+	error_offset = offset + R::reserved::offset;
+	if (r.size() < R::reserved::end) return 8;
+	uint32_t data_vaddr = R::data_rva::read(r.data());
+	uint32_t data_size  = R::data_size::read(r.data());
+	data = section.subrange(uint32_t(data_vaddr - section_virtual_address), data_size);
+	error_offset = offset;
+	if (data.size() != data_size) return 9;
+	return 0;
 }
 
-void write_uint16(unsigned char * data, uint16_t value) {
-	data[0] = value      & 0xFF;
-	data[1] = value >> 8 & 0xFF;
+// The name or ID of a key that has been checked by check_name already.
+ResourceName key_name(mstd::range<unsigned char const> section, ResourceKey key) {
+	if (!key.is_name()) return ResourceName(key.value);
+	auto data = section.data() + key.name_offset();
+	size_t length = data[0] | data[1] << 8;
+	return ResourceName(mstd::range<unsigned char const>(data + 2, length * 2));
 }
 
-void write_uint32(unsigned char * data, uint32_t value) {
-	data[0] = value       & 0xFF;
-	data[1] = value >>  8 & 0xFF;
-	data[2] = value >> 16 & 0xFF;
-	data[3] = value >> 24 & 0xFF;
+// The key must have been checked by check_name already.
+int compare_key(mstd::range<unsigned char const> section, ResourceKey a, ResourceQuery const & b) {
+	if (a.is_name() != b.is_name) return a.is_name() ? -1 : 1;
+	if (!a.is_name()) return a.value < b.id ? -1 : a.value > b.id;
+	auto name = key_name(section, a);
+	for (size_t i = 0; i < name.size() && i < b.name.size(); ++i) {
+		if (name[i] != b.name[i]) return name[i] < b.name[i] ? -1 : 1;
+	}
+	return name.size() < b.name.size() ? -1 : name.size() > b.name.size();
 }
 
-std::u16string resource_name(uint32_t name, mstd::range<unsigned char const> section) {
-	if (name & 0x80000000) {
-		uint32_t offset = name & 0x7FFFFFFF;
-		auto data = section.subrange(offset);
-		size_t length = read_uint16(data, 100);
-		std::u16string s;
-		s.reserve(length);
-		for (size_t i = 0; i < length; ++i) {
-			s.push_back(read_uint16(data, 101));
+[[noreturn]] void throw_resource_error(int error) {
+	throw std::runtime_error("Unable to parse resource section. (Error " + std::to_string(error) + ")");
+}
+
+// Walks the resource directories like ResourceDirectory, with the same checks,
+// and collects all resources in entries. Instead of throwing, returns false
+// and leaves the error in error and error_offset.
+struct ResourceWalk {
+	mstd::range<unsigned char const> section;
+	uint32_t section_virtual_address;
+	std::vector<ResourceTable::Entry> & entries;
+	ResourceKey key[3];
+	int error;
+	size_t error_offset;
+
+	bool check(int e) {
+		error = e;
+		return e == 0;
+	}
+
+	bool fail(int e, size_t offset) {
+		error = e;
+		error_offset = offset;
+		return false;
+	}
+
+	bool directory(size_t offset, int level) {
+		using D = layout::ResourceDirectory;
+		using E = layout::ResourceDirectoryEntry;
+		if (!check(check_directory(section, offset, error_offset))) return false;
+		auto data = section.data() + offset;
+		size_t n_entries = size_t(D::n_named_entries::read(data)) + D::n_id_entries::read(data);
+
+		for (size_t i = 0; i < n_entries; ++i) {
+			// There, as checked above.
+			size_t entry_offset = offset + D::size + i * E::size;
+			uint32_t target = E::target::read(section.data() + entry_offset);
+
+			key[level] = ResourceKey{E::key::read(section.data() + entry_offset)};
+			if (key[level].is_name() && !check(check_name(section, key[level].name_offset(), error_offset))) return false;
+
+			if (target & 0x80000000) {
+				if (level >= 2) return fail(10, entry_offset + E::target::offset);
+				if (!directory(target & 0x7FFFFFFF, level + 1)) return false;
+			} else {
+				if (level != 2) return fail(11, entry_offset + E::target::offset);
+				mstd::range<unsigned char const> d;
+				if (!check(check_data_entry(section, section_virtual_address, target, d, error_offset))) return false;
+				entries.push_back({key[0], key[1], key[2], d});
+			}
 		}
-		return s;
+		return true;
+	}
+};
+
+}
+
+std::u16string ResourceName::to_string() const {
+	if (!is_name_) return from_number(id_);
+	std::u16string s(size(), 0);
+	for (size_t i = 0; i < s.size(); ++i) s[i] = (*this)[i];
+	return s;
+}
+
+std::string ResourceName::to_utf8() const {
+	if (!is_name_) return std::to_string(id_);
+	return PE::to_utf8(bytes());
+}
+
+int ResourceName::compare(ResourceName const & other) const {
+	if (is_name_ != other.is_name_) return is_name_ ? -1 : 1;
+	if (!is_name_) return id_ < other.id_ ? -1 : id_ > other.id_;
+	size_t n = std::min(id_, other.id_);
+	size_t i = 0;
+	if (name_ == other.name_) {
+		i = n;
+	} else {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// Skip the common prefix four characters at a time.
+		for (; i + 4 <= n; i += 4) {
+			uint64_t a, b;
+			std::memcpy(&a, name_ + 2 * i, 8);
+			std::memcpy(&b, other.name_ + 2 * i, 8);
+			if (a != b) {
+				i += __builtin_ctzll(a ^ b) / 16;
+				break;
+			}
+		}
+#endif
+	}
+	for (; i < n; ++i) {
+		char16_t a = (*this)[i];
+		char16_t b = other[i];
+		if (a != b) return a < b ? -1 : 1;
+	}
+	return id_ < other.id_ ? -1 : id_ > other.id_;
+}
+
+size_t ResourceName::hash() const {
+	// FNV-1a, over the bytes of the name or the ID.
+	uint64_t h = is_name_ ? 0xcbf29ce484222325 : 0x84222325cbf29ce4;
+	auto add = [&] (unsigned char c) {
+		h ^= c;
+		h *= 0x100000001b3;
+	};
+	if (is_name_) {
+		for (size_t i = 0; i < size_t(id_) * 2; ++i) add(name_[i]);
 	} else {
-		return from_number(name);
+		for (int i = 0; i < 32; i += 8) add(id_ >> i);
+	}
+	return h;
+}
+
+ResourceQuery::ResourceQuery(std::u16string const & name)
+	: ResourceQuery(parse(mstd::range<char16_t const>(name.data(), name.size()))) {}
+
+ResourceQuery::ResourceQuery(mstd::range<char16_t const> name) : is_name(true), name(name) {}
+
+ResourceQuery ResourceQuery::parse(mstd::range<char16_t const> name) {
+	if (name.empty()) return ResourceQuery(name);
+	uint32_t id = 0;
+	for (char16_t c : name) {
+		if (c < u'0' || c > u'9') return ResourceQuery(name);
+		id = id * 10 + (c - u'0');
 	}
+	return ResourceQuery(id);
 }
 
-void parse_resources_(
+ResourceDirectory::ResourceDirectory(
 	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address
+) : ResourceDirectory(resource_section, section_virtual_address, 0, 0) {}
+
+ResourceDirectory::ResourceDirectory(
+	mstd::range<unsigned char const> section,
 	uint32_t section_virtual_address,
-	int level,
-	mstd::range<unsigned char const> data,
-	ResourceId & id,
-	std::map<ResourceId, mstd::range<unsigned char const>> & resources
-) {
-	data.remove_prefix(12); // Skip unused fields.
+	uint32_t offset,
+	int level
+) try :
+	section_(section),
+	section_virtual_address_(section_virtual_address),
+	offset_(offset),
+	level_(level)
+{
+	using D = layout::ResourceDirectory;
+	size_t error_offset;
+	if (int error = check_directory(section, offset, error_offset)) throw error;
+	n_named_entries_ = D::n_named_entries::read(section.data() + offset);
+	n_id_entries_    = D::n_id_entries::read(section.data() + offset);
+} catch (int error) {
+	throw_resource_error(error);
+}
 
-	uint16_t n_named_entries = read_uint16(data, 1);
-	uint16_t n_id_entries    = read_uint16(data, 2);
+ResourceDirectory::Entry ResourceDirectory::operator [] (size_t i) const {
+	Entry entry;
+	entry.section_ = section_;
+	entry.section_virtual_address_ = section_virtual_address_;
+	entry.offset_ = offset_ + layout::ResourceDirectory::size + i * layout::ResourceDirectoryEntry::size;
+	entry.level_ = level_;
+	return entry;
+}
 
-	size_t n_entries = n_named_entries + n_id_entries;
+ResourceDirectory::Entry ResourceDirectory::find(ResourceQuery const & query) const try {
+	if (query.is_name) {
+		for (size_t i = 0; i < n_named_entries_; ++i) {
+			auto entry = (*this)[i];
+			if (compare_key(section_, entry.key(), query) == 0) return entry;
+		}
+	} else {
+		size_t begin = n_named_entries_;
+		size_t end = size();
+		bool sorted = true;
+		while (begin < end) {
+			size_t i = begin + (end - begin) / 2;
+			auto entry = (*this)[i];
+			auto key = entry.key();
+			int x = compare_key(section_, key, query);
+			if (x == 0) return entry;
+			if (i > n_named_entries_) {
+				auto previous = (*this)[i - 1].key();
+				if (key.is_name() || previous.is_name() || previous.value >= key.value) {
+					sorted = false;
+					break;
+				}
+			}
+			if (x < 0) begin = i + 1;
+			else end = i;
+		}
+		// Only look at all IDs if the search ran into some that aren't sorted.
+		if (sorted) return Entry();
+		for (size_t i = n_named_entries_; i < size(); ++i) {
+			auto entry = (*this)[i];
+			if (compare_key(section_, entry.key(), query) == 0) return entry;
+		}
+	}
+	return Entry();
+} catch (int error) {
+	throw_resource_error(error);
+}
 
-	for (size_t i = 0; i < n_entries; ++i) {
-		uint32_t name   = read_uint32(data, 3);
-		uint32_t offset = read_uint32(data, 4);
+ResourceDirectory::Entry ResourceDirectory::find(ResourceQuery const & a, ResourceQuery const & b) const {
+	auto entry = find(a);
+	if (!entry || !entry.is_directory()) return Entry();
+	return entry.directory().find(b);
+}
+
+ResourceDirectory::Entry ResourceDirectory::find(ResourceQuery const & a, ResourceQuery const & b, ResourceQuery const & c) const {
+	auto entry = find(a, b);
+	if (!entry || !entry.is_directory()) return Entry();
+	return entry.directory().find(c);
+}
+
+ResourceKey ResourceDirectory::Entry::key() const try {
+	auto data = section_.subrange(offset_ + layout::ResourceDirectoryEntry::key::offset);
+	ResourceKey key = {read_uint32(data, 3)};
+	size_t error_offset;
+	if (key.is_name()) {
+		if (int error = check_name(section_, key.name_offset(), error_offset)) throw error;
+	}
+	return key;
+} catch (int error) {
+	throw_resource_error(error);
+}
 
-		id[level] = resource_name(name, resource_section);
+ResourceName ResourceDirectory::Entry::name() const {
+	return key_name(section_, key());
+}
 
-		if (offset < 0x80000000) {
-			if (level != 2) throw 11;
+bool ResourceDirectory::Entry::is_directory() const try {
+	auto data = section_.subrange(offset_ + layout::ResourceDirectoryEntry::target::offset);
+	return read_uint32(data, 4) & 0x80000000;
+} catch (int error) {
+	throw_resource_error(error);
+}
 
-			auto r = resource_section.subrange(offset, 16);
-			uint32_t data_vaddr = read_uint32(r, 5);
-			uint32_t data_size  = read_uint32(r, 6);
-			read_uint32(r, 7); // code_page
-			read_uint32(r, 8); // resource_handle
+ResourceDirectory ResourceDirectory::Entry::directory() const try {
+	auto data = section_.subrange(offset_ + layout::ResourceDirectoryEntry::target::offset);
+	uint32_t offset = read_uint32(data, 4);
+	if (offset < 0x80000000) throw 11;
+	if (level_ >= 2) throw 10;
+	return ResourceDirectory(section_, section_virtual_address_, offset & 0x7FFFFFFF, level_ + 1);
+} catch (int error) {
+	throw_resource_error(error);
+}
 
-			auto data = resource_section.subrange(data_vaddr - section_virtual_address, data_size);
-			if (data.size() != data_size) throw 9;
-			resources.emplace(id, data);
+mstd::range<unsigned char const> ResourceDirectory::Entry::data() const try {
+	auto data = section_.subrange(offset_ + layout::ResourceDirectoryEntry::target::offset);
+	uint32_t offset = read_uint32(data, 4);
+	if (offset >= 0x80000000) throw 10;
+	if (level_ != 2) throw 11;
 
-		} else {
-			if (level >= 2) throw 10;
-			offset &= 0x7FFFFFFF;
-			parse_resources_(resource_section, section_virtual_address, level + 1, resource_section.subrange(offset), id, resources);
-		}
+	mstd::range<unsigned char const> d;
+	size_t error_offset;
+	if (int error = check_data_entry(section_, section_virtual_address_, offset, d, error_offset)) throw error;
+	return d;
+} catch (int error) {
+	throw_resource_error(error);
+}
+
+mstd::range<unsigned char const> find_resource(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address,
+	ResourceQuery const & type
+) {
+	auto entry = ResourceDirectory(resource_section, section_virtual_address).find(type);
+	while (entry && entry.is_directory()) {
+		auto directory = entry.directory();
+		entry = directory.size() ? directory[0] : ResourceDirectory::Entry();
 	}
+	return entry ? entry.data() : mstd::range<unsigned char const>();
 }
 
+mstd::range<unsigned char const> find_resource(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address,
+	ResourceQuery const & type,
+	ResourceQuery const & name
+) {
+	auto entry = ResourceDirectory(resource_section, section_virtual_address).find(type, name);
+	while (entry && entry.is_directory()) {
+		auto directory = entry.directory();
+		entry = directory.size() ? directory[0] : ResourceDirectory::Entry();
+	}
+	return entry ? entry.data() : mstd::range<unsigned char const>();
 }
 
-std::map<ResourceId, mstd::range<unsigned char const>> parse_resources(
+ResourceTable::ResourceTable(
 	mstd::range<unsigned char const> resource_section,
 	uint32_t section_virtual_address
-) try {
-	std::map<ResourceId, mstd::range<unsigned char const>> resources;
+) {
+	try_parse(resource_section, section_virtual_address).value();
+}
 
-	ResourceId resource_id;
-	parse_resources_(resource_section, section_virtual_address, 0, resource_section, resource_id, resources);
+Result<void> ResourceTable::try_parse(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address
+) {
+	PE_STAGE(parse_resources);
+	section_ = resource_section;
+	entries_.clear();
+	ResourceWalk walk = {resource_section, section_virtual_address, entries_, {}, 0, 0};
+	if (!walk.directory(0, 0)) {
+		entries_.clear();
+		return Error{Stage::parse_resources, walk.error, walk.error_offset};
+	}
+
+	auto less = [this] (Entry const & a, Entry const & b) {
+		for (size_t i = 0; i < 3; ++i) {
+			if (int x = compare(a[i], b[i])) return x < 0;
+		}
+		return false;
+	};
+
+	// Resource directories are normally sorted already.
+	if (!std::is_sorted(entries_.begin(), entries_.end(), less)) {
+		std::stable_sort(entries_.begin(), entries_.end(), less);
+	}
+
+	// Like the map from parse_resources, only keep the first of any duplicates.
+	entries_.erase(std::unique(entries_.begin(), entries_.end(), [&] (Entry const & a, Entry const & b) {
+		return !less(a, b);
+	}), entries_.end());
+
+	PE_COUNT(entries, entries_.size());
+	return {};
+}
+
+int ResourceTable::compare(ResourceKey a, ResourceKey b) const {
+	if (a.value == b.value) return 0;
+	return name(a).compare(name(b));
+}
+
+mstd::range<ResourceTable::Entry const> ResourceTable::equal_range(ResourceQuery const * const * query, size_t n_levels) const {
+	auto compare_prefix = [&] (Entry const & e) {
+		for (size_t i = 0; i < n_levels; ++i) {
+			if (int x = compare_key(section_, e[i], *query[i])) return x;
+		}
+		return 0;
+	};
+	auto first = std::partition_point(begin(), end(), [&] (Entry const & e) { return compare_prefix(e) < 0; });
+	auto last = std::partition_point(first, end(), [&] (Entry const & e) { return compare_prefix(e) == 0; });
+	return {first, last};
+}
+
+ResourceTable::Entry const * ResourceTable::find(ResourceQuery const & type, ResourceQuery const & name, ResourceQuery const & lang) const {
+	ResourceQuery const * query[] = {&type, &name, &lang};
+	auto r = equal_range(query, 3);
+	return r.empty() ? nullptr : r.data();
+}
+
+mstd::range<ResourceTable::Entry const> ResourceTable::find(ResourceQuery const & type) const {
+	ResourceQuery const * query[] = {&type};
+	return equal_range(query, 1);
+}
 
+mstd::range<ResourceTable::Entry const> ResourceTable::find(ResourceQuery const & type, ResourceQuery const & name) const {
+	ResourceQuery const * query[] = {&type, &name};
+	return equal_range(query, 2);
+}
+
+ResourceName ResourceTable::name(ResourceKey key) const {
+	return key_name(section_, key);
+}
+
+std::u16string ResourceTable::key_string(ResourceKey key) const {
+	return name(key).to_string();
+}
+
+ResourceId ResourceTable::id(Entry const & entry) const {
+	return ResourceId(key_string(entry.type), key_string(entry.name), key_string(entry.lang));
+}
+
+std::map<ResourceId, mstd::range<unsigned char const>> ResourceTable::to_map() const {
+	std::map<ResourceId, mstd::range<unsigned char const>> resources;
+	for (auto const & entry : entries_) {
+		resources.emplace_hint(resources.end(), id(entry), entry.data);
+	}
 	return resources;
-} catch (int error) {
-	throw std::runtime_error("Unable to parse resource section. (Error " + std::to_string(error) + ")");
+}
+
+std::map<ResourceId, mstd::range<unsigned char const>> parse_resources(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address
+) {
+	return try_parse_resources(resource_section, section_virtual_address).value();
+}
+
+Result<std::map<ResourceId, mstd::range<unsigned char const>>> try_parse_resources(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address
+) {
+	PE_STAGE(parse_resources);
+	ResourceTable table;
+	auto parsed = table.try_parse(resource_section, section_virtual_address);
+	if (!parsed) return parsed.error();
+	return table.to_map();
 }
 
 bool is_numeric(std::u16string const & s) {
@@ -127,14 +504,13 @@ bool is_numeric(std::u16string const & s) {
 }
 
 std::u16string from_number(uint32_t value) {
-	char buf[11];
-	size_t n = snprintf(buf, sizeof(buf), "%d", value);
-	std::u16string s;
-	s.reserve(n);
-	for (size_t i = 0; i < n; ++i) {
-		s.push_back(buf[i]);
-	}
-	return s;
+	char16_t buf[10];
+	size_t n = 0;
+	do {
+		buf[sizeof(buf) / sizeof(buf[0]) - ++n] = u'0' + value % 10;
+		value /= 10;
+	} while (value);
+	return std::u16string(std::end(buf) - n, std::end(buf));
 }
 
 uint32_t to_number(std::u16string const & s) {
@@ -153,99 +529,130 @@ void align(std::vector<unsigned char> & data, unsigned int alignment) {
 	data.resize((data.size() + alignment - 1) & ~(alignment - 1));
 }
 
-struct NameBlock {
-	std::u16string const * name;
-	size_t parent_pointer_offset;
-};
+using ResourceIterator = std::map<ResourceId, mstd::range<unsigned char const>>::const_iterator;
 
-struct ResBlock {
-	mstd::range<unsigned char const> data;
-	size_t parent_pointer_offset;
-};
+size_t align(size_t offset, size_t alignment) {
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
 
-void serialize_resources_1(
-	std::map<ResourceId, mstd::range<unsigned char const>>::const_iterator begin,
-	std::map<ResourceId, mstd::range<unsigned char const>>::const_iterator end,
+// Sizing pass: counts the entries of every directory table (in the order they
+// are serialized), the size of the names, and the size of the data.
+void layout_resources(
+	ResourceIterator begin,
+	ResourceIterator end,
 	int level,
-	std::vector<unsigned char> & data,
-	std::vector<NameBlock> & name_blocks,
-	std::vector<ResBlock> & res_blocks
+	std::vector<uint32_t> & tables,
+	size_t & tables_size,
+	size_t & names_size,
+	size_t & n_resources,
+	size_t & data_size
 ) {
-	size_t n_named_entries = 0;
-	size_t n_id_entries = 0;
+	size_t table = tables.size();
+	tables.push_back(0);
 
-	for (auto i = begin, last = end; i != end; last = i++) {
+	uint32_t n_named_entries = 0;
+	uint32_t n_id_entries = 0;
+
+	auto i = begin;
+	while (i != end) {
 		std::u16string const & n = i->first[level];
-		if (last == end || last->first[level] != n) {
-			++(is_numeric(n) ? n_id_entries : n_named_entries);
+		if (is_numeric(n)) {
+			++n_id_entries;
+		} else {
+			++n_named_entries;
+			names_size += 2 + n.size() * 2;
+		}
+		auto b = i;
+		while (++i != end && i->first[level] == n);
+		if (level < 2) {
+			layout_resources(b, i, level + 1, tables, tables_size, names_size, n_resources, data_size);
+		} else {
+			assert(std::next(b) == i);
+			++n_resources;
+			data_size += align(b->second.size(), 8);
 		}
 	}
 
-	size_t n_entries = n_named_entries + n_id_entries;
+	if (n_named_entries > 0xFFFF || n_id_entries > 0xFFFF) {
+		throw std::runtime_error("Unable to serialize resource section. (Too many entries)");
+	}
+	tables[table] = n_named_entries << 16 | n_id_entries;
+	tables_size += layout::ResourceDirectory::size + (n_named_entries + n_id_entries) * layout::ResourceDirectoryEntry::size;
+}
+
+// Where the fill pass writes the next table, name, data entry and data.
+struct Cursors {
+	size_t table_index;
+	size_t table;
+	size_t name;
+	size_t entry;
+	size_t data;
+	size_t resource_index;
+};
+
+// Fill pass: writes everything at the offsets computed by the sizing pass.
+void serialize_resources_(
+	ResourceIterator begin,
+	ResourceIterator end,
+	int level,
+	unsigned char * out,
+	uint32_t section_virtual_address,
+	uint32_t const * data_rvas,
+	std::vector<uint32_t> const & tables,
+	Cursors & c
+) {
+	uint32_t counts = tables[c.table_index++];
+	size_t n_entries = (counts >> 16) + (counts & 0xFFFF);
 
-	size_t start_offset = data.size();
+	using D = layout::ResourceDirectory;
+	using E = layout::ResourceDirectoryEntry;
+	using R = layout::ResourceDataEntry;
 
-	data.resize(data.size() + 16 + n_entries * 8);
+	size_t start_offset = c.table;
+	c.table += D::size + n_entries * E::size;
 
-	write_uint16(data.data() + start_offset + 12, n_named_entries);
-	write_uint16(data.data() + start_offset + 14, n_id_entries);
+	std::fill_n(out + start_offset, D::n_named_entries::offset, 0);
+	D::n_named_entries::write(out + start_offset, counts >> 16);
+	D::n_id_entries::write(out + start_offset, counts & 0xFFFF);
 
-	size_t entries_offset = start_offset + 16;
+	size_t entries_offset = start_offset + D::size;
 
 	auto i = begin;
 	while (i != end) {
 		std::u16string const & n = i->first[level];
 		if (is_numeric(n)) {
-			write_uint32(data.data() + entries_offset, to_number(n));
+			E::key::write(out + entries_offset, to_number(n));
 		} else {
-			NameBlock b;
-			b.parent_pointer_offset = entries_offset;
-			b.name = &n;
-			name_blocks.push_back(std::move(b));
+			E::key::write(out + entries_offset, c.name | 0x80000000);
+			write_uint16(out + c.name, n.size());
+			for (size_t j = 0; j < n.size(); ++j) {
+				write_uint16(out + c.name + 2 + j * 2, n[j]);
+			}
+			c.name += 2 + n.size() * 2;
 		}
 		auto b = i;
 		while (++i != end && i->first[level] == n);
 		if (level < 2) {
-			write_uint32(data.data() + entries_offset + 4, data.size() | 0x80000000);
-			serialize_resources_1(b, i, level + 1, data, name_blocks, res_blocks);
+			E::target::write(out + entries_offset, c.table | 0x80000000);
+			serialize_resources_(b, i, level + 1, out, section_virtual_address, data_rvas, tables, c);
 		} else {
-			assert(std::next(b) == i);
-			ResBlock r;
-			r.parent_pointer_offset = entries_offset + 4;
-			r.data = b->second;
-			res_blocks.push_back(std::move(r));
-		}
-		entries_offset += 8;
-	}
-}
-
-void serialize_resources_2(
-	std::vector<unsigned char> & data,
-	uint32_t section_virtual_address,
-	std::vector<NameBlock> const & name_blocks,
-	std::vector<ResBlock> const & res_blocks
-) {
-	align(data, 2);
-	for (auto const & b : name_blocks) {
-		size_t offset = data.size();
-		data.push_back(b.name->size()      & 0xFF);
-		data.push_back(b.name->size() >> 8 & 0xFF);
-		for (char c : *b.name) {
-			data.push_back(c);
-			data.push_back(0);
+			auto const & data = b->second;
+			E::target::write(out + entries_offset, c.entry);
+			if (data_rvas) {
+				R::data_rva::write(out + c.entry, data_rvas[c.resource_index]);
+			} else {
+				R::data_rva::write(out + c.entry, c.data + section_virtual_address);
+				std::copy(data.begin(), data.end(), out + c.data);
+				std::fill(out + c.data + data.size(), out + align(c.data + data.size(), 8), 0);
+				c.data = align(c.data + data.size(), 8);
+			}
+			R::data_size::write(out + c.entry, data.size());
+			R::code_page::write(out + c.entry, 0);
+			R::reserved::write(out + c.entry, 0);
+			c.entry += R::size;
+			++c.resource_index;
 		}
-		write_uint32(data.data() + b.parent_pointer_offset, offset | 0x80000000);
-	}
-	align(data, 8);
-	size_t res_offset = data.size();
-	data.resize(data.size() + res_blocks.size() * 16);
-	for (auto const & b : res_blocks) {
-		write_uint32(data.data() + b.parent_pointer_offset, res_offset);
-		write_uint32(data.data() + res_offset, data.size() + section_virtual_address);
-		write_uint32(data.data() + res_offset + 4, b.data.size());
-		res_offset += 16;
-		data.insert(data.end(), b.data.begin(), b.data.end());
-		align(data, 8);
+		entries_offset += E::size;
 	}
 }
 
@@ -275,17 +682,166 @@ std::vector<unsigned char> serialize_resources(
 	std::map<ResourceId, mstd::range<unsigned char const>> const & resources,
 	uint32_t section_virtual_address
 ) {
-	std::vector<unsigned char> section;
-	std::vector<NameBlock> name_blocks;
-	std::vector<ResBlock> res_blocks;
+	PE_STAGE(serialize_resources);
+	ResourceLayout layout(resources);
+	std::vector<unsigned char> section(layout.size());
+	layout.serialize(section, section_virtual_address);
+	return section;
+}
 
-	// Serialize the structure, and populate {name,res}_blocks.
-	serialize_resources_1(resources.begin(), resources.end(), 0, section, name_blocks, res_blocks);
+ResourceLayout::ResourceLayout(
+	std::map<ResourceId, mstd::range<unsigned char const>> const & resources
+) : resources_(resources) {
+	size_t tables_size = 0;
+	size_t names_size = 0;
+	size_t n_resources = 0;
+	size_t data_size = 0;
+	layout_resources(resources.begin(), resources.end(), 0, tables_, tables_size, names_size, n_resources, data_size);
+	names_offset_ = tables_size;
+	entries_offset_ = align(names_offset_ + names_size, 8);
+	data_offset_ = entries_offset_ + n_resources * layout::ResourceDataEntry::size;
+	size_ = data_offset_ + data_size;
+}
 
-	// Serialize {name,res}_blocks, and fill in the pointers/offsets to these blocks.
-	serialize_resources_2(section, section_virtual_address, name_blocks, res_blocks);
+void ResourceLayout::serialize(mstd::range<unsigned char> out, uint32_t section_virtual_address) const {
+	if (out.size() < size_) throw std::runtime_error("Unable to serialize resource section. (Buffer too small)");
+	serialize(out.data(), section_virtual_address, nullptr);
+}
 
-	return section;
+void ResourceLayout::serialize(unsigned char * out, uint32_t section_virtual_address, uint32_t const * data_rvas) const {
+	PE_STAGE(serialize_resources);
+	PE_COUNT(bytes_written, size_);
+	PE_COUNT(entries, resources_.size());
+	Cursors c = {0, 0, names_offset_, entries_offset_, data_offset_, 0};
+	serialize_resources_(resources_.begin(), resources_.end(), 0, out, section_virtual_address, data_rvas, tables_, c);
+	std::fill(out + c.name, out + entries_offset_, 0);
+}
+
+void ResourcePatch::replace(ResourceId id, mstd::range<unsigned char const> data) {
+	changes_[std::move(id)] = Change{false, data};
+}
+
+void ResourcePatch::remove(ResourceId id) {
+	changes_[std::move(id)] = Change{true, {}};
+}
+
+namespace {
+
+size_t const nowhere = size_t(-1);
+
+// Where the data of a resource will be in the patched section.
+struct Placement {
+	size_t target = nowhere;
+	size_t size = 0;
+	size_t source = nowhere; // Offset of the data in the old section, if it's there.
+	mstd::range<unsigned char const> data; // New data, if source == nowhere.
+};
+
+}
+
+void ResourcePatch::apply(std::vector<unsigned char> & section, uint32_t section_virtual_address) const {
+	PE_STAGE(serialize_resources);
+	auto resources = parse_resources(section, section_virtual_address);
+
+	std::map<ResourceId, Placement> placements;
+	for (auto const & r : resources) {
+		Placement p;
+		p.source = p.target = r.second.data() - section.data();
+		p.size = r.second.size();
+		placements.emplace_hint(placements.end(), r.first, p);
+	}
+
+	// New data can come from the section itself, which is moved, zeroed and
+	// possibly reallocated below, so such data is copied out first. Moving the
+	// inner vectors when this grows doesn't move their data.
+	std::vector<std::vector<unsigned char>> copies;
+	std::less<unsigned char const *> before;
+	unsigned char const * section_begin = section.data();
+	unsigned char const * section_end = section.data() + section.size();
+
+	for (auto const & c : changes_) {
+		if (c.second.remove) {
+			resources.erase(c.first);
+			placements.erase(c.first);
+			continue;
+		}
+		auto data = c.second.data;
+		if (!data.empty() && before(data.data(), section_end) && before(section_begin, data.data() + data.size())) {
+			copies.emplace_back(data.begin(), data.end());
+			data = copies.back();
+		}
+		resources[c.first] = data;
+		auto & p = placements[c.first];
+		Placement q;
+		q.size = data.size();
+		q.data = data;
+		if (p.source != nowhere && q.size <= p.size) q.target = p.source;
+		p = q;
+	}
+
+	// New data can only replace old data in place if it doesn't overlap the
+	// data of any other resource.
+	{
+		std::vector<std::pair<size_t, size_t>> ranges; // (offset, index)
+		std::vector<Placement *> index;
+		for (auto & p : placements) {
+			if (p.second.target == nowhere || p.second.size == 0) continue;
+			ranges.emplace_back(p.second.target, index.size());
+			index.push_back(&p.second);
+		}
+		std::sort(ranges.begin(), ranges.end());
+		size_t end = 0;
+		for (size_t i = 0; i < ranges.size(); ++i) {
+			Placement & p = *index[ranges[i].second];
+			size_t p_end = p.target + p.size;
+			bool overlaps = (i > 0 && p.target < end) || (i + 1 < ranges.size() && ranges[i + 1].first < p_end);
+			end = std::max(end, p_end);
+			if (overlaps && p.source == nowhere) p.target = nowhere;
+		}
+	}
+
+	ResourceLayout layout(resources);
+	size_t directory_size = layout.directory_size();
+
+	// Data that's in the way of the new directory has to move. Everything
+	// that has to move or is new goes to the end of the section.
+	size_t new_size = std::max(section.size(), directory_size);
+	for (auto & p : placements) {
+		if (p.second.target != nowhere && p.second.target >= directory_size) continue;
+		p.second.target = (new_size + 7) & ~size_t(7);
+		new_size = (p.second.target + p.second.size + 7) & ~size_t(7);
+	}
+
+	section.resize(new_size);
+
+	for (auto const & p : placements) {
+		if (p.second.source != nowhere && p.second.target != p.second.source) {
+			std::copy_n(section.data() + p.second.source, p.second.size, section.data() + p.second.target);
+		}
+	}
+
+	// Zero everything that's no longer used.
+	std::vector<std::pair<size_t, size_t>> used;
+	used.reserve(placements.size());
+	for (auto const & p : placements) used.emplace_back(p.second.target, p.second.target + p.second.size);
+	std::sort(used.begin(), used.end());
+	size_t unused = directory_size;
+	for (auto const & u : used) {
+		if (u.first > unused) std::fill(section.begin() + unused, section.begin() + u.first, 0);
+		unused = std::max(unused, u.second);
+	}
+	std::fill(section.begin() + unused, section.end(), 0);
+
+	for (auto const & p : placements) {
+		if (p.second.source == nowhere) {
+			std::copy(p.second.data.begin(), p.second.data.end(), section.data() + p.second.target);
+		}
+	}
+
+	std::vector<uint32_t> data_rvas;
+	data_rvas.reserve(placements.size());
+	for (auto const & p : placements) data_rvas.push_back(p.second.target + section_virtual_address);
+	layout.serialize(section.data(), section_virtual_address, data_rvas.data());
 }
 
 namespace {
@@ -301,55 +857,96 @@ struct VerInfoNode {
 	std::vector<VerInfoNode> children;
 };
 
-unsigned char const * x = nullptr;
-VerInfoNode parse_ver_info_node(mstd::range<unsigned char const> & data) {
-	VerInfoNode node;
+std::u16string decode_utf16(mstd::range<unsigned char const> data) {
+	std::u16string s;
+	s.reserve(data.size() / 2);
+	for (size_t i = 0; i + 1 < data.size(); i += 2) s.push_back(data[i] | data[i + 1] << 8);
+	return s;
+}
 
-	if (!x) x = data.data();
+// Parses version information nodes with the same checks (and error numbers)
+// as VersionInfoTree::parse. Instead of throwing, returns false and leaves
+// the error in error and error_offset.
+struct VersionInfoParser {
+	unsigned char const * begin;
+	std::vector<VersionInfoNode> & nodes;
+	int error;
+	size_t error_offset;
+
+	bool fail(int e, mstd::range<unsigned char const> at) {
+		error = e;
+		error_offset = at.data() - begin;
+		return false;
+	}
 
-	size_t size = read_uint16(data, 101);
+	// Parses a node and its children into nodes, and sets index to its index.
+	bool parse(mstd::range<unsigned char const> & data, uint32_t & index) {
+		uint16_t node_size;
+		if (!take_uint16(data, node_size)) return fail(101, data);
+		size_t size = node_size;
 
-	auto d = data.subrange(0, size - 2);
-	if (d.size() != size - 2) throw 102;
+		auto d = data.subrange(0, size - 2);
+		if (d.size() != size - 2) return fail(102, data);
 
-	while (size % 4 != 0) ++size;
-	data.remove_prefix(std::min(data.size(), size - 2));
+		while (size % 4 != 0) ++size;
+		data.remove_prefix(std::min(data.size(), size - 2));
 
-	size_t val_len = read_uint16(d, 103);
-	uint16_t type = read_uint16(d, 104);
+		uint16_t val_len, type;
+		if (!take_uint16(d, val_len)) return fail(103, d);
+		if (!take_uint16(d, type)) return fail(104, d);
 
-	while (char16_t c = read_uint16(d, 105)) {
-		node.name.push_back(c);
-	}
+		VersionInfoNode node;
+		node.first_child = node.next_sibling = VersionInfoNode::none;
 
-	if (node.name.size() % 2 != 0) d.remove_prefix(2); // Alignment.
+		size_t name_length = 0;
+		while (true) {
+			if (d.size() < name_length * 2 + 2) return fail(105, d);
+			if (!d[name_length * 2] && !d[name_length * 2 + 1]) break;
+			++name_length;
+		}
+		node.name = d.subrange(0, name_length * 2);
+		d.remove_prefix(name_length * 2 + 2);
+
+		if (name_length % 2 != 0) d.remove_prefix(std::min<size_t>(d.size(), 2)); // Alignment.
+
+		if (type == 0) {
+			node.is_string = false;
+			node.value = d.subrange(0, val_len);
+			d.remove_prefix(node.value.size());
+			if (val_len % 4) d.remove_prefix(std::min(d.size(), size_t(4 - (val_len % 4))));
+		} else if (type == 1) {
+			node.is_string = true;
+			if (val_len > 0) {
+				node.value = d.subrange(0, (val_len - 1) * 2);
+				if (node.value.size() != size_t(val_len - 1) * 2) return fail(107, d);
+				d.remove_prefix(node.value.size());
+				uint16_t terminator;
+				if (!take_uint16(d, terminator)) return fail(108, d);
+				if (terminator != 0) return fail(109, d);
+				if (val_len % 2) d.remove_prefix(std::min<size_t>(d.size(), 2));
+			}
+		} else {
+			return fail(106, d);
+		}
 
-	if (type == 0) {
-		node.is_string = false;
-		node.data = d.subrange(0, val_len);
-		d.remove_prefix(val_len);
-		if (val_len % 4) d.remove_prefix(std::min(d.size(), 4 - (val_len % 4)));
-	} else if (type == 1) {
-		node.is_string = true;
-		node.data = d.subrange(0, val_len * 2);
-		if (val_len > 0) {
-			node.string_value.reserve(val_len - 1);
-			for (size_t i = 0; i < val_len - 1; ++i) {
-				node.string_value.push_back(read_uint16(d, 107));
+		index = nodes.size();
+		nodes.push_back(node);
+
+		uint32_t last_child = VersionInfoNode::none;
+		while (!d.empty()) {
+			uint32_t child;
+			if (!parse(d, child)) return false;
+			if (last_child == VersionInfoNode::none) {
+				nodes[index].first_child = child;
+			} else {
+				nodes[last_child].next_sibling = child;
 			}
-			if (read_uint16(d, 108) != 0) throw 109; // Terminating null.
-			if (val_len % 2) d.remove_prefix(std::min<size_t>(d.size(), 2));
+			last_child = child;
 		}
-	} else {
-		throw 106;
-	}
 
-	while (!d.empty()) {
-		node.children.push_back(parse_ver_info_node(d));
+		return true;
 	}
-
-	return node;
-}
+};
 
 void serialize_ver_info_node(std::vector<unsigned char> & data, VerInfoNode const & node) {
 	size_t s = data.size();
@@ -385,85 +982,235 @@ void serialize_ver_info_node(std::vector<unsigned char> & data, VerInfoNode cons
 
 }
 
-VersionInfo parse_version_info(mstd::range<unsigned char const> data) try {
-	VersionInfo info = {};
+constexpr uint32_t VersionInfoNode::none;
 
-	auto root = parse_ver_info_node(data);
-
-	if (root.name != u"VS_VERSION_INFO") throw 1;
-	if (root.is_string) throw 2;
-
-	info.signature        = read_uint32(root.data, 3);
-	info.struc_version    = read_uint32(root.data, 4);
-	info.file_version     = read_uint32(root.data, 5);
-	info.file_version    |= uint64_t(read_uint32(root.data, 6)) << 32;
-	info.product_version  = read_uint32(root.data, 7);
-	info.product_version |= uint64_t(read_uint32(root.data, 8)) << 32;
-	info.file_flags_mask  = read_uint32(root.data, 9);
-	info.file_flags       = read_uint32(root.data, 10);
-	info.file_os          = read_uint32(root.data, 11);
-	info.file_type        = read_uint32(root.data, 12);
-	info.file_subtype     = read_uint32(root.data, 13);
-	info.file_date        = read_uint32(root.data, 14);
-	info.file_date       |= uint64_t(read_uint32(root.data, 15)) << 32;
-
-	if (root.data.size() > 2) throw 16;
-
-	if (info.signature != 0xFEEF04BD) throw 17;
-
-	for (auto const & c : root.children) {
-		if (c.name == u"StringFileInfo") {
-			if (info.string_file_info) throw 18;
-			if (!c.data.empty()) throw 19;
-			info.string_file_info = std::make_unique<StringFileInfo>();
-			for (auto const & b : c.children) {
-				std::vector<std::pair<std::u16string, std::u16string>> values;
-				for (auto const & v : b.children) {
-					if (!v.is_string || !v.children.empty()) throw 20;
-					values.emplace_back(std::move(v.name), std::move(v.string_value));
+bool VersionInfoNode::name_equals(std::u16string const & s) const {
+	if (name.size() != s.size() * 2) return false;
+	for (size_t i = 0; i < s.size(); ++i) {
+		if (name[i * 2] != (s[i] & 0xFF) || name[i * 2 + 1] != s[i] >> 8) return false;
+	}
+	return true;
+}
+
+std::u16string VersionInfoNode::name_string() const {
+	return decode_utf16(name);
+}
+
+std::u16string VersionInfoNode::value_string() const {
+	return decode_utf16(value);
+}
+
+std::string VersionInfoNode::name_utf8() const {
+	return to_utf8(name);
+}
+
+std::string VersionInfoNode::value_utf8() const {
+	return to_utf8(value);
+}
+
+void StringFileInfo::set(std::string const & block, std::string const & name, std::string const & value) {
+	auto block16 = to_utf16(block);
+	auto name16 = to_utf16(name);
+	auto b = std::find_if(blocks.begin(), blocks.end(), [&] (auto const & x) { return x.first == block16; });
+	if (b == blocks.end()) {
+		blocks.emplace_back(std::move(block16), std::vector<std::pair<std::u16string, std::u16string>>());
+		b = std::prev(blocks.end());
+	}
+	auto v = std::find_if(b->second.begin(), b->second.end(), [&] (auto const & x) { return x.first == name16; });
+	if (v == b->second.end()) {
+		b->second.emplace_back(std::move(name16), to_utf16(value));
+	} else {
+		v->second = to_utf16(value);
+	}
+}
+
+void VersionInfoTree::parse(mstd::range<unsigned char const> data) {
+	try_parse(data).value();
+}
+
+Result<void> VersionInfoTree::try_parse(mstd::range<unsigned char const> data) {
+	PE_STAGE(parse_version_info);
+	nodes_.clear();
+	fixed_ = {};
+	string_file_info_ = var_file_info_ = VersionInfoNode::none;
+
+	VersionInfoParser parser = {data.data(), nodes_, 0, 0};
+	auto fail = [&] (int error, mstd::range<unsigned char const> at) {
+		nodes_.clear();
+		parser.fail(error, at);
+		return Error{Stage::parse_version_info, parser.error, parser.error_offset};
+	};
+	// The start of a node, of which the name follows the 6 byte header.
+	auto node_at = [] (VersionInfoNode const & node) {
+		return mstd::range<unsigned char const>(node.name.data() - 6, size_t(0));
+	};
+
+	auto d = data;
+	uint32_t root_index;
+	if (!parser.parse(d, root_index)) {
+		nodes_.clear();
+		return Error{Stage::parse_version_info, parser.error, parser.error_offset};
+	}
+	PE_COUNT(entries, nodes_.size());
+
+	auto const & root = nodes_[0];
+
+	if (!root.name_equals(u"VS_VERSION_INFO")) return fail(1, node_at(root));
+	if (root.is_string) return fail(2, node_at(root));
+
+	// Error 3 to 15 for the first of the 32-bit words that's missing.
+	using F = layout::FixedFileInfo;
+	d = root.value;
+	if (d.size() < F::size) {
+		size_t n = d.size() / 4;
+		return fail(3 + int(n), d.subrange(n * 4));
+	}
+	auto p = d.data();
+	fixed_.signature       = F::signature::read(p);
+	fixed_.struc_version   = F::struc_version::read(p);
+	fixed_.file_version    = F::file_version::read(p);
+	fixed_.product_version = F::product_version::read(p);
+	fixed_.file_flags_mask = F::file_flags_mask::read(p);
+	fixed_.file_flags      = F::file_flags::read(p);
+	fixed_.file_os         = F::file_os::read(p);
+	fixed_.file_type       = F::file_type::read(p);
+	fixed_.file_subtype    = F::file_subtype::read(p);
+	fixed_.file_date       = F::file_date::read(p);
+	d.remove_prefix(F::size);
+
+	if (d.size() > 2) return fail(16, d);
+
+	if (fixed_.signature != F::signature_value) return fail(17, root.value);
+
+	for (uint32_t c = root.first_child; c != VersionInfoNode::none; c = nodes_[c].next_sibling) {
+		auto const & child = nodes_[c];
+		if (child.name_equals(u"StringFileInfo")) {
+			if (string_file_info_ != VersionInfoNode::none) return fail(18, node_at(child));
+			if (!child.value.empty()) return fail(19, node_at(child));
+			string_file_info_ = c;
+			for (uint32_t b = child.first_child; b != VersionInfoNode::none; b = nodes_[b].next_sibling) {
+				for (uint32_t v = nodes_[b].first_child; v != VersionInfoNode::none; v = nodes_[v].next_sibling) {
+					if (!nodes_[v].is_string || nodes_[v].first_child != VersionInfoNode::none) return fail(20, node_at(nodes_[v]));
 				}
-				info.string_file_info->blocks.emplace_back(
-					std::move(b.name), std::move(values)
-				);
 			}
-		} else if (c.name == u"VarFileInfo") {
-			if (info.var_file_info) throw 21;
-			if (!c.data.empty()) throw 22;
-			info.var_file_info = std::make_unique<VarFileInfo>();
-			for (auto const & v : c.children) {
-				if (v.is_string || !v.children.empty()) throw 23;
-				info.var_file_info->values.emplace_back(
-					std::move(v.name),
-					std::vector<unsigned char>(v.data.begin(), v.data.end())
-				);
+		} else if (child.name_equals(u"VarFileInfo")) {
+			if (var_file_info_ != VersionInfoNode::none) return fail(21, node_at(child));
+			if (!child.value.empty()) return fail(22, node_at(child));
+			var_file_info_ = c;
+			for (uint32_t v = child.first_child; v != VersionInfoNode::none; v = nodes_[v].next_sibling) {
+				if (nodes_[v].is_string || nodes_[v].first_child != VersionInfoNode::none) return fail(23, node_at(nodes_[v]));
 			}
 		} else {
-			throw 24;
+			return fail(24, node_at(child));
+		}
+	}
+
+	return {};
+}
+
+VersionInfo VersionInfoTree::to_version_info() const {
+	VersionInfo info = {};
+	info.signature       = fixed_.signature;
+	info.struc_version   = fixed_.struc_version;
+	info.file_version    = fixed_.file_version;
+	info.product_version = fixed_.product_version;
+	info.file_flags_mask = fixed_.file_flags_mask;
+	info.file_flags      = fixed_.file_flags;
+	info.file_os         = fixed_.file_os;
+	info.file_type       = fixed_.file_type;
+	info.file_subtype    = fixed_.file_subtype;
+	info.file_date       = fixed_.file_date;
+
+	if (string_file_info_ != VersionInfoNode::none) {
+		info.string_file_info = std::make_unique<StringFileInfo>();
+		for (uint32_t b = nodes_[string_file_info_].first_child; b != VersionInfoNode::none; b = nodes_[b].next_sibling) {
+			std::vector<std::pair<std::u16string, std::u16string>> values;
+			for (uint32_t v = nodes_[b].first_child; v != VersionInfoNode::none; v = nodes_[v].next_sibling) {
+				values.emplace_back(nodes_[v].name_string(), nodes_[v].value_string());
+			}
+			info.string_file_info->blocks.emplace_back(nodes_[b].name_string(), std::move(values));
+		}
+	}
+
+	if (var_file_info_ != VersionInfoNode::none) {
+		info.var_file_info = std::make_unique<VarFileInfo>();
+		for (uint32_t v = nodes_[var_file_info_].first_child; v != VersionInfoNode::none; v = nodes_[v].next_sibling) {
+			info.var_file_info->values.emplace_back(
+				nodes_[v].name_string(),
+				std::vector<unsigned char>(nodes_[v].value.begin(), nodes_[v].value.end())
+			);
 		}
 	}
 
 	return info;
+}
 
-} catch (int error) {
-	throw std::runtime_error("Unable to parse version information. (Error " + std::to_string(error) + ")");
+void VersionStrings::assign(VersionInfoTree const & tree) {
+	entries_.clear();
+	uint32_t string_file_info = tree.string_file_info();
+	if (string_file_info == VersionInfoNode::none) return;
+
+	// Make room for the longest possible result first, so that the entries
+	// can refer to the buffer while it's being filled.
+	size_t size = 0;
+	for (uint32_t b = tree[string_file_info].first_child; b != VersionInfoNode::none; b = tree[b].next_sibling) {
+		size += max_utf8_size(tree[b].name.size() / 2);
+		for (uint32_t v = tree[b].first_child; v != VersionInfoNode::none; v = tree[v].next_sibling) {
+			size += max_utf8_size(tree[v].name.size() / 2) + max_utf8_size(tree[v].value.size() / 2);
+		}
+	}
+	if (buffer_.size() < size) buffer_.resize(size);
+
+	char * out = &buffer_[0];
+	auto add = [&] (mstd::range<unsigned char const> utf16le) {
+		char * start = out;
+		out += utf16_to_utf8(utf16le, out);
+		return mstd::range<char const>(start, size_t(out - start));
+	};
+	for (uint32_t b = tree[string_file_info].first_child; b != VersionInfoNode::none; b = tree[b].next_sibling) {
+		auto block = add(tree[b].name);
+		for (uint32_t v = tree[b].first_child; v != VersionInfoNode::none; v = tree[v].next_sibling) {
+			auto name = add(tree[v].name);
+			entries_.push_back({block, name, add(tree[v].value)});
+		}
+	}
 }
 
-std::vector<unsigned char> serialize_version_info(VersionInfo const & info) {
+VersionStrings::Entry const * VersionStrings::find(char const * name) const {
+	size_t length = std::strlen(name);
+	for (auto const & e : entries_) {
+		if (e.name.size() == length && std::memcmp(e.name.data(), name, length) == 0) return &e;
+	}
+	return nullptr;
+}
+
+VersionInfo parse_version_info(mstd::range<unsigned char const> data) {
+	return try_parse_version_info(data).value();
+}
+
+Result<VersionInfo> try_parse_version_info(mstd::range<unsigned char const> data) {
+	PE_STAGE(parse_version_info);
+	VersionInfoTree tree;
+	auto parsed = tree.try_parse(data);
+	if (!parsed) return parsed.error();
+	return tree.to_version_info();
+}
 
-	unsigned char fixed_version_info[0x34];
-	write_uint32(fixed_version_info + 0x00, info.signature);
-	write_uint32(fixed_version_info + 0x04, info.struc_version);
-	write_uint32(fixed_version_info + 0x08, info.file_version);
-	write_uint32(fixed_version_info + 0x0c, info.file_version >> 32);
-	write_uint32(fixed_version_info + 0x10, info.product_version);
-	write_uint32(fixed_version_info + 0x14, info.product_version >> 32);
-	write_uint32(fixed_version_info + 0x18, info.file_flags_mask);
-	write_uint32(fixed_version_info + 0x1c, info.file_flags);
-	write_uint32(fixed_version_info + 0x20, info.file_os);
-	write_uint32(fixed_version_info + 0x24, info.file_type);
-	write_uint32(fixed_version_info + 0x28, info.file_subtype);
-	write_uint32(fixed_version_info + 0x2c, info.file_date);
-	write_uint32(fixed_version_info + 0x30, 0);
+std::vector<unsigned char> serialize_version_info(VersionInfo const & info) {
+	PE_STAGE(serialize_version_info);
+
+	using F = layout::FixedFileInfo;
+	unsigned char fixed_version_info[F::size];
+	F::signature::write(fixed_version_info, info.signature);
+	F::struc_version::write(fixed_version_info, info.struc_version);
+	F::file_version::write(fixed_version_info, info.file_version);
+	F::product_version::write(fixed_version_info, info.product_version);
+	F::file_flags_mask::write(fixed_version_info, info.file_flags_mask);
+	F::file_flags::write(fixed_version_info, info.file_flags);
+	F::file_os::write(fixed_version_info, info.file_os);
+	F::file_type::write(fixed_version_info, info.file_type);
+	F::file_subtype::write(fixed_version_info, info.file_subtype);
+	F::file_date::write(fixed_version_info, info.file_date);
 
 	VerInfoNode root;
 	root.name = u"VS_VERSION_INFO";
@@ -503,6 +1250,7 @@ std::vector<unsigned char> serialize_version_info(VersionInfo const & info) {
 
 	std::vector<unsigned char> data;
 	serialize_ver_info_node(data, root);
+	PE_COUNT(bytes_written, data.size());
 	return data;
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -9,6 +11,8 @@
 
 #include <mstd/range.hpp>
 
+#include "pe-result.hpp"
+
 namespace PE {
 
 struct ResourceId {
@@ -36,12 +40,306 @@ std::map<ResourceId, mstd::range<unsigned char const>> parse_resources(
 	uint32_t section_virtual_address
 );
 
+// Like parse_resources, but returning an Error instead of throwing.
+Result<std::map<ResourceId, mstd::range<unsigned char const>>> try_parse_resources(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address
+);
+
+// One level (type, name or language) of the identifier of a resource in a
+// ResourceTable. Encoded as in the resource directory: either a numeric ID, or
+// (with the highest bit set) the offset of a name in the resource section.
+struct ResourceKey {
+	uint32_t value;
+	bool is_name() const { return value & 0x80000000; }
+	uint32_t name_offset() const { return value & 0x7FFFFFFF; }
+};
+
+// A type, name or language of a resource as stored in a resource section:
+// either a numeric ID, or a name that refers to its UTF-16LE characters in the
+// section, which must outlive it.
+//
+// Names are compared and hashed directly on those bytes, without decoding
+// them. They sort before all IDs, as in ResourceId.
+class ResourceName {
+public:
+	ResourceName() {}
+	ResourceName(uint32_t id) : id_(id) {}
+
+	// The characters of the name, without length or terminating null.
+	explicit ResourceName(mstd::range<unsigned char const> utf16le)
+		: name_(utf16le.data()), id_(utf16le.size() / 2), is_name_(true) {}
+
+	bool is_name() const { return is_name_; }
+
+	// Only if !is_name().
+	uint32_t id() const { return id_; }
+
+	// Only if is_name().
+	size_t size() const { return id_; }
+	char16_t operator [] (size_t i) const { return name_[2 * i] | name_[2 * i + 1] << 8; }
+	mstd::range<unsigned char const> bytes() const { return {name_, size_t(id_) * 2}; }
+
+	// Decode into a string, as used in ResourceId.
+	std::u16string to_string() const;
+
+	// The same, as UTF-8.
+	std::string to_utf8() const;
+
+	int compare(ResourceName const &) const;
+	size_t hash() const;
+
+	friend bool operator == (ResourceName const & a, ResourceName const & b) { return a.compare(b) == 0; }
+	friend bool operator != (ResourceName const & a, ResourceName const & b) { return a.compare(b) != 0; }
+	friend bool operator <  (ResourceName const & a, ResourceName const & b) { return a.compare(b) < 0; }
+
+private:
+	unsigned char const * name_ = nullptr;
+	uint32_t id_ = 0; // The length, for names.
+	bool is_name_ = false;
+};
+
+// A type, name or language to look up in a ResourceTable. As in ResourceId,
+// strings consisting of only digits are numeric IDs.
+//
+// A name is not copied: the string a query is made from must outlive it, so
+// e.g. `ResourceQuery q = make_name();` leaves q dangling. Passing a temporary
+// directly to find() is fine.
+struct ResourceQuery {
+	ResourceQuery(uint32_t id) : is_name(false), id(id) {}
+	ResourceQuery(std::u16string const & name);
+	template<size_t N>
+	ResourceQuery(char16_t const (&name)[N]) : ResourceQuery(parse(mstd::range<char16_t const>(name, N - 1))) {}
+
+	// Always a name, even if it consists of only digits.
+	explicit ResourceQuery(mstd::range<char16_t const> name);
+
+	// A name, or a numeric ID if it consists of only digits.
+	static ResourceQuery parse(mstd::range<char16_t const> name);
+
+	bool is_name;
+	uint32_t id = 0;
+	mstd::range<char16_t const> name;
+};
+
+// One directory of the resource tree, read directly from the resource section
+// when needed, without parsing the rest of the section.
+//
+// The root directory contains one entry per type, each of which is a
+// directory with one entry per name, each of which is a directory with one
+// entry per language, which refers to the data of the resource.
+class ResourceDirectory {
+public:
+	class Entry {
+	public:
+		Entry() {}
+
+		// False for the entry returned by find() if nothing was found.
+		explicit operator bool () const { return offset_ != 0; }
+
+		ResourceKey key() const;
+		ResourceName name() const;
+		bool is_directory() const;
+
+		// Only if is_directory().
+		ResourceDirectory directory() const;
+
+		// Only if !is_directory().
+		mstd::range<unsigned char const> data() const;
+
+	private:
+		friend class ResourceDirectory;
+		mstd::range<unsigned char const> section_;
+		uint32_t section_virtual_address_ = 0;
+		uint32_t offset_ = 0;
+		int level_ = 0;
+	};
+
+	class iterator {
+	public:
+		iterator(ResourceDirectory const * directory, size_t i) : directory_(directory), i_(i) {}
+		Entry operator * () const { return (*directory_)[i_]; }
+		iterator & operator ++ () { ++i_; return *this; }
+		bool operator == (iterator const & other) const { return i_ == other.i_; }
+		bool operator != (iterator const & other) const { return i_ != other.i_; }
+	private:
+		ResourceDirectory const * directory_;
+		size_t i_;
+	};
+
+	ResourceDirectory() {}
+
+	// The root directory of a resource section.
+	ResourceDirectory(mstd::range<unsigned char const> resource_section, uint32_t section_virtual_address);
+
+	// 0 for the root (types), 1 for names, 2 for languages.
+	int level() const { return level_; }
+
+	size_t size() const { return n_named_entries_ + n_id_entries_; }
+	Entry operator [] (size_t i) const;
+	iterator begin() const { return iterator(this, 0); }
+	iterator end() const { return iterator(this, size()); }
+
+	// Find an entry in this directory, or in its subdirectories.
+	//
+	// Entries with numeric IDs are found with a binary search, since the
+	// resource directory is supposed to be sorted. (If nothing is found, it
+	// falls back to a linear search, in case it wasn't.)
+	Entry find(ResourceQuery const &) const;
+	Entry find(ResourceQuery const &, ResourceQuery const &) const;
+	Entry find(ResourceQuery const &, ResourceQuery const &, ResourceQuery const &) const;
+
+private:
+	ResourceDirectory(mstd::range<unsigned char const> section, uint32_t section_virtual_address, uint32_t offset, int level);
+
+	mstd::range<unsigned char const> section_;
+	uint32_t section_virtual_address_ = 0;
+	uint32_t offset_ = 0;
+	int level_ = 0;
+	uint16_t n_named_entries_ = 0;
+	uint16_t n_id_entries_ = 0;
+};
+
+// The data of the first resource with the given type (and name), in any
+// language, or an empty range if there is none. E.g. find_resource(s, a, 16)
+// gives the version information.
+mstd::range<unsigned char const> find_resource(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address,
+	ResourceQuery const & type
+);
+mstd::range<unsigned char const> find_resource(
+	mstd::range<unsigned char const> resource_section,
+	uint32_t section_virtual_address,
+	ResourceQuery const & type,
+	ResourceQuery const & name
+);
+
+// All resources of a resource section, as a sorted array.
+//
+// This is equivalent to the map returned by parse_resources, in the same
+// order, but without allocating anything per resource. Names are kept as
+// offsets into the resource section, which must outlive the table.
+class ResourceTable {
+public:
+	struct Entry {
+		ResourceKey type;
+		ResourceKey name;
+		ResourceKey lang;
+		mstd::range<unsigned char const> data;
+		ResourceKey operator [] (size_t i) const {
+			return i == 0 ? type : i == 1 ? name : lang;
+		}
+	};
+
+	ResourceTable() {}
+	ResourceTable(mstd::range<unsigned char const> resource_section, uint32_t section_virtual_address);
+
+	// Like the constructor, but returning an Error instead of throwing, after
+	// which the table is empty. Reuses the memory of the previous entries.
+	Result<void> try_parse(mstd::range<unsigned char const> resource_section, uint32_t section_virtual_address);
+
+	std::vector<Entry> const & entries() const { return entries_; }
+	size_t size() const { return entries_.size(); }
+	Entry const * begin() const { return entries_.data(); }
+	Entry const * end() const { return entries_.data() + entries_.size(); }
+
+	// The resource with the given type, name and language, or null.
+	Entry const * find(ResourceQuery const & type, ResourceQuery const & name, ResourceQuery const & lang) const;
+
+	// All resources with the given type (and name).
+	mstd::range<Entry const> find(ResourceQuery const & type) const;
+	mstd::range<Entry const> find(ResourceQuery const & type, ResourceQuery const & name) const;
+
+	ResourceName name(ResourceKey) const;
+
+	// Decode a key into a string, as used in ResourceId.
+	std::u16string key_string(ResourceKey) const;
+	ResourceId id(Entry const &) const;
+
+	std::map<ResourceId, mstd::range<unsigned char const>> to_map() const;
+
+private:
+	int compare(ResourceKey, ResourceKey) const;
+	mstd::range<Entry const> equal_range(ResourceQuery const * const * query, size_t n_levels) const;
+
+	mstd::range<unsigned char const> section_;
+	std::vector<Entry> entries_;
+};
+
 std::vector<unsigned char> serialize_resources(
 	std::map<ResourceId, mstd::range<unsigned char const>> const & resources,
 	uint32_t section_virtual_address
 );
 
+// The exact layout of a resource section as serialize_resources would
+// serialize it, computed without serializing anything yet.
+//
+// This allows serializing directly into a buffer of the right size, such as
+// the section in an output file, instead of into a growing std::vector.
+class ResourceLayout {
+public:
+	// The resources must outlive the layout.
+	explicit ResourceLayout(std::map<ResourceId, mstd::range<unsigned char const>> const & resources);
+
+	size_t size() const { return size_; }
+
+	// The size of the directory, names and data entries, which are followed
+	// by the data of the resources.
+	size_t directory_size() const { return data_offset_; }
+
+	// Serialize into a buffer of at least size() bytes.
+	void serialize(mstd::range<unsigned char> out, uint32_t section_virtual_address) const;
+
+private:
+	friend class ResourcePatch;
+
+	// If data_rvas is given, only the directory is serialized, with the
+	// data of the resources at the given addresses instead.
+	void serialize(unsigned char * out, uint32_t section_virtual_address, uint32_t const * data_rvas) const;
+
+	std::map<ResourceId, mstd::range<unsigned char const>> const & resources_;
+	std::vector<uint32_t> tables_; // n_named_entries << 16 | n_id_entries, in order.
+	size_t names_offset_ = 0;
+	size_t entries_offset_ = 0;
+	size_t data_offset_ = 0;
+	size_t size_ = 0;
+};
+
+// Changes to individual resources, which can be applied to a resource section
+// without re-serializing all of it.
+class ResourcePatch {
+public:
+	// Add a resource, or replace it if it already exists. The data must
+	// stay valid until the patch is applied.
+	void replace(ResourceId, mstd::range<unsigned char const> data);
+
+	void remove(ResourceId);
+
+	// Apply the changes to a resource section, in place.
+	//
+	// Only the directory and the data of the changed resources are written.
+	// The data of all other resources stays where it is, unless it's in the
+	// way of the new directory, in which case it's moved to the end. New data
+	// replaces old data in place if it fits, or is added to the end of the
+	// section otherwise. Space that's no longer used is zeroed.
+	//
+	// The section might grow. Its virtual size needs to be updated to match.
+	void apply(std::vector<unsigned char> & resource_section, uint32_t section_virtual_address) const;
+
+private:
+	struct Change {
+		bool remove;
+		mstd::range<unsigned char const> data;
+	};
+	std::map<ResourceId, Change> changes_;
+};
+
 struct StringFileInfo {
+	// Set a value, adding the block and the value if they don't exist yet.
+	// All arguments are UTF-8.
+	void set(std::string const & block, std::string const & name, std::string const & value);
+
 	std::vector<std::pair<
 		std::u16string, // Block name (e.g. "000004b0")
 		std::vector<std::pair<
@@ -75,6 +373,117 @@ struct VersionInfo {
 
 VersionInfo parse_version_info(mstd::range<unsigned char const>);
 
+// Like parse_version_info, but returning an Error instead of throwing.
+Result<VersionInfo> try_parse_version_info(mstd::range<unsigned char const>);
+
+// A node of a version information resource, as stored in a VersionInfoTree.
+struct VersionInfoNode {
+	static constexpr uint32_t none = 0xFFFFFFFF;
+
+	// UTF-16LE, without the terminating null.
+	mstd::range<unsigned char const> name;
+
+	// For string nodes: UTF-16LE, without the terminating null.
+	mstd::range<unsigned char const> value;
+
+	bool is_string;
+
+	// Indices in the VersionInfoTree, or none.
+	uint32_t first_child;
+	uint32_t next_sibling;
+
+	bool name_equals(std::u16string const &) const;
+	std::u16string name_string() const;
+	std::u16string value_string() const;
+
+	// As UTF-8. See also append_utf8 in pe-utf.hpp.
+	std::string name_utf8() const;
+	std::string value_utf8() const;
+};
+
+// A version information resource, parsed without copying any names or values.
+//
+// All nodes are stored in one array, in depth-first order, and refer to the
+// resource data, which needs to outlive the tree. The array is reused by the
+// next parse(), so parsing many resources with the same tree stops allocating
+// once the array is large enough.
+class VersionInfoTree {
+public:
+	VersionInfoTree() = default;
+	explicit VersionInfoTree(mstd::range<unsigned char const> data) { parse(data); }
+
+	// A tree of nodes that were parsed before, such as the ones stored in a
+	// CacheEntry. The fixed information's pointers should be null.
+	VersionInfoTree(VersionInfo fixed, std::vector<VersionInfoNode> nodes, uint32_t string_file_info, uint32_t var_file_info)
+		: nodes_(std::move(nodes)), fixed_(std::move(fixed)),
+		string_file_info_(string_file_info), var_file_info_(var_file_info) {}
+
+	// Checks the same things as parse_version_info, and throws the same errors.
+	void parse(mstd::range<unsigned char const>);
+
+	// Like parse, but returning an Error instead of throwing, after which the
+	// tree is empty.
+	Result<void> try_parse(mstd::range<unsigned char const>);
+
+	std::vector<VersionInfoNode> const & nodes() const { return nodes_; }
+	VersionInfoNode const & operator[] (uint32_t i) const { return nodes_[i]; }
+	VersionInfoNode const & root() const { return nodes_[0]; }
+
+	// The index of the StringFileInfo or VarFileInfo node, or VersionInfoNode::none.
+	uint32_t string_file_info() const { return string_file_info_; }
+	uint32_t var_file_info() const { return var_file_info_; }
+
+	// The fixed information. Its var_file_info and string_file_info are null.
+	VersionInfo const & fixed() const { return fixed_; }
+
+	// Copy everything into a VersionInfo.
+	VersionInfo to_version_info() const;
+
+private:
+	std::vector<VersionInfoNode> nodes_;
+	VersionInfo fixed_ = {};
+	uint32_t string_file_info_ = VersionInfoNode::none;
+	uint32_t var_file_info_ = VersionInfoNode::none;
+};
+
+// The strings in the StringFileInfo of a VersionInfoTree, as UTF-8.
+//
+// All names and values are transcoded into one buffer, which is reused by the
+// next assign(), like the nodes of a VersionInfoTree.
+class VersionStrings {
+public:
+	struct Entry {
+		mstd::range<char const> block; // E.g. "040904b0".
+		mstd::range<char const> name;  // E.g. "FileDescription".
+		mstd::range<char const> value;
+	};
+
+	VersionStrings() = default;
+	explicit VersionStrings(VersionInfoTree const & tree) { assign(tree); }
+
+	// Copying would leave the entries referring to the other buffer.
+	VersionStrings(VersionStrings const &) = delete;
+	VersionStrings & operator = (VersionStrings const &) = delete;
+
+	void assign(VersionInfoTree const &);
+
+	// In the order of the tree.
+	std::vector<Entry> const & entries() const { return entries_; }
+
+	// The first value with the given name in any block, or null.
+	Entry const * find(char const * name) const;
+
+private:
+	std::string buffer_;
+	std::vector<Entry> entries_;
+};
+
 std::vector<unsigned char> serialize_version_info(VersionInfo const &);
 
 }
+
+namespace std {
+	template<> struct hash<PE::ResourceName> {
+		size_t operator () (PE::ResourceName const & n) const { return n.hash(); }
+	};
+}
@@ -0,0 +1,30 @@
+#include <stdexcept>
+#include <string>
+
+#include "pe-result.hpp"
+
+namespace PE {
+
+constexpr int Error::cannot_open;
+
+char const * Error::message() const {
+	if (reason == cannot_open) return "Unable to open file.";
+	switch (stage) {
+		case Stage::read_pe_file:
+		case Stage::read_pe_image:
+			return "Unable to parse PE file.";
+		case Stage::parse_resources:
+			return "Unable to parse resource section.";
+		case Stage::parse_version_info:
+			return "Unable to parse version information.";
+		default:
+			return "Unknown error.";
+	}
+}
+
+void Error::raise() const {
+	if (reason == cannot_open) throw std::runtime_error(message());
+	throw std::runtime_error(std::string(message()) + " (Error " + std::to_string(reason) + ")");
+}
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include "pe-stats.hpp"
+
+namespace PE {
+
+// Why a try_ function failed. Creating or copying one never allocates.
+struct Error {
+	// The reason when a file couldn't be opened.
+	static constexpr int cannot_open = 0;
+
+	// read_pe_file, read_pe_image, parse_resources or parse_version_info.
+	Stage stage;
+
+	// The error number the throwing function puts in its message, e.g.
+	// "Unable to parse PE file. (Error 7)", or cannot_open.
+	int reason;
+
+	// How far into the file, resource section or version information
+	// everything was read when the problem was found.
+	uint64_t offset;
+
+	// The message of the throwing function, without the error number.
+	char const * message() const;
+
+	// Throw the exception the throwing function would throw.
+	[[noreturn]] void raise() const;
+};
+
+// Either a T or an Error, returned by the try_ functions.
+template<typename T>
+class Result {
+public:
+	Result(T && value) : ok_(true) { new (&value_) T(std::move(value)); }
+	Result(T const & value) : ok_(true) { new (&value_) T(value); }
+	Result(Error error) : ok_(false) { new (&error_) Error(error); }
+
+	Result(Result && other) : ok_(other.ok_) {
+		if (ok_) new (&value_) T(std::move(other.value_));
+		else new (&error_) Error(other.error_);
+	}
+
+	Result(Result const & other) : ok_(other.ok_) {
+		if (ok_) new (&value_) T(other.value_);
+		else new (&error_) Error(other.error_);
+	}
+
+	Result & operator = (Result const &) = delete;
+
+	~Result() { if (ok_) value_.~T(); }
+
+	bool ok() const { return ok_; }
+	explicit operator bool () const { return ok_; }
+
+	// Only if ok().
+	T & operator * () & { return value_; }
+	T const & operator * () const & { return value_; }
+	T && operator * () && { return std::move(value_); }
+	T * operator -> () { return &value_; }
+	T const * operator -> () const { return &value_; }
+
+	// Only if !ok().
+	Error const & error() const { return error_; }
+
+	// The value, or throws what the throwing function would have thrown.
+	T & value() & { if (!ok_) error_.raise(); return value_; }
+	T const & value() const & { if (!ok_) error_.raise(); return value_; }
+	T && value() && { if (!ok_) error_.raise(); return std::move(value_); }
+
+private:
+	bool ok_;
+	union {
+		T value_;
+		Error error_;
+	};
+};
+
+// Nothing, or an Error.
+template<>
+class Result<void> {
+public:
+	Result() : ok_(true), error_() {}
+	Result(Error error) : ok_(false), error_(error) {}
+
+	bool ok() const { return ok_; }
+	explicit operator bool () const { return ok_; }
+
+	// Only if !ok().
+	Error const & error() const { return error_; }
+
+	// Throws what the throwing function would have thrown, if !ok().
+	void value() const { if (!ok_) error_.raise(); }
+
+private:
+	bool ok_;
+	Error error_;
+};
+
+}
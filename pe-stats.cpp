@@ -0,0 +1,106 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "pe-instrument.hpp"
+#include "pe-stats.hpp"
+
+namespace PE {
+
+char const * stage_name(Stage stage) {
+	switch (stage) {
+		case Stage::read_pe_file:           return "read_pe_file";
+		case Stage::read_pe_image:          return "read_pe_image";
+		case Stage::write_pe_file:          return "write_pe_file";
+		case Stage::parse_resources:        return "parse_resources";
+		case Stage::serialize_resources:    return "serialize_resources";
+		case Stage::parse_version_info:     return "parse_version_info";
+		case Stage::serialize_version_info: return "serialize_version_info";
+	}
+	return "unknown";
+}
+
+void StageStats::add(StageStats const & s) {
+	calls         += s.calls;
+	nanoseconds   += s.nanoseconds;
+	bytes_read    += s.bytes_read;
+	bytes_written += s.bytes_written;
+	io_calls      += s.io_calls;
+	allocations   += s.allocations;
+	entries       += s.entries;
+}
+
+#ifdef PE_INSTRUMENTATION
+
+namespace {
+
+std::atomic<StageCallback> stage_callback{nullptr};
+
+// The number of allocations made by this thread so far.
+thread_local uint64_t allocation_count = 0;
+
+}
+
+thread_local StageScope * current_stage = nullptr;
+
+Stats & thread_stats() {
+	thread_local Stats stats;
+	return stats;
+}
+
+void set_stage_callback(StageCallback callback) {
+	stage_callback = callback;
+}
+
+StageScope::StageScope(Stage stage) : stage_(stage) {
+	active_ = !current_stage || current_stage->stage_ != stage;
+	if (!active_) return;
+	outer_ = current_stage;
+	current_stage = this;
+	allocations_ = allocation_count;
+	start_ = std::chrono::steady_clock::now();
+}
+
+StageScope::~StageScope() {
+	if (!active_) return;
+	auto elapsed = std::chrono::steady_clock::now() - start_;
+	current_stage = outer_;
+	stats.calls = 1;
+	stats.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+	stats.allocations = allocation_count - allocations_;
+	thread_stats()[stage_].add(stats);
+	if (StageCallback callback = stage_callback) callback(stage_, stats);
+	// The time and allocations of the outer stage include this one already,
+	// but PE_COUNT only counts for the innermost stage.
+	if (outer_) {
+		outer_->stats.bytes_read    += stats.bytes_read;
+		outer_->stats.bytes_written += stats.bytes_written;
+		outer_->stats.io_calls      += stats.io_calls;
+		outer_->stats.entries       += stats.entries;
+	}
+}
+
+#endif
+
+}
+
+#if defined(PE_INSTRUMENTATION) && defined(PE_INSTRUMENTATION_ALLOCATIONS)
+
+// Count every allocation of the program, so the stages can report their own.
+// The other forms of new and delete use these by default.
+
+void * operator new (size_t size) {
+	++PE::allocation_count;
+	if (void * p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+void operator delete (void * p) noexcept {
+	std::free(p);
+}
+
+void operator delete (void * p, size_t) noexcept {
+	std::free(p);
+}
+
+#endif
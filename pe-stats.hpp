@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace PE {
+
+// The parts of the library that are instrumented when it's built with
+// PE_INSTRUMENTATION defined. Also used in Error.
+enum class Stage : uint8_t {
+	read_pe_file,
+	read_pe_image,
+	write_pe_file,
+	parse_resources,
+	serialize_resources,
+	parse_version_info,
+	serialize_version_info,
+};
+
+constexpr size_t n_stages = 7;
+
+char const * stage_name(Stage);
+
+// The numbers of a stage include those of the other stages it runs, e.g.
+// ResourcePatch::apply (serialize_resources) parses the resources first.
+struct StageStats {
+	uint64_t calls = 0;
+	uint64_t nanoseconds = 0; // Wall time.
+	uint64_t bytes_read = 0;
+	uint64_t bytes_written = 0;
+	uint64_t io_calls = 0; // System calls, or stdio calls when using a FILE *.
+	uint64_t allocations = 0; // Only with PE_INSTRUMENTATION_ALLOCATIONS.
+	uint64_t entries = 0; // Sections, resources or version information nodes.
+
+	void add(StageStats const &);
+};
+
+struct Stats {
+	StageStats stages[n_stages];
+
+	StageStats & operator [] (Stage s) { return stages[size_t(s)]; }
+	StageStats const & operator [] (Stage s) const { return stages[size_t(s)]; }
+};
+
+#ifdef PE_INSTRUMENTATION
+
+// The totals of all stages that ran on the calling thread. Can be reset by
+// assigning Stats() to it.
+Stats & thread_stats();
+
+// Called at the end of every stage (on the thread that ran it), with the
+// numbers of that one call. Null (the default) for none.
+using StageCallback = void (*)(Stage, StageStats const &);
+void set_stage_callback(StageCallback);
+
+#endif
+
+}
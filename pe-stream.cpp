@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "pe-bytes.hpp"
+#include "pe-stream.hpp"
+
+namespace PE {
+
+namespace {
+
+[[noreturn]] void throw_stream_error(int error) {
+	throw std::runtime_error("Unable to parse PE file. (Error " + std::to_string(error) + ")");
+}
+
+StreamSource file_source(FILE * f) {
+	return [f] (unsigned char * buffer, size_t size) {
+		size_t n = std::fread(buffer, 1, size, f);
+		if (n == 0 && std::ferror(f)) throw std::runtime_error("Unable to read from file.");
+		return n;
+	};
+}
+
+}
+
+constexpr size_t StreamReader::npos;
+constexpr size_t StreamReader::default_buffer_size;
+
+// Same checks (and error numbers) as read_pe_image, in the order the bytes
+// arrive.
+StreamReader::StreamReader(StreamSource source, size_t buffer_size) try
+	: source_(std::move(source)), buffer_(std::max<size_t>(buffer_size, 1)) {
+
+	// Make sure at least size bytes of the headers were read. The offsets in
+	// the headers can't be trusted, so this grows by at most buffer_size
+	// bytes at a time, and only as far as bytes actually arrive.
+	auto ensure = [this] (size_t size, int error) {
+		while (headers_.size() < size) {
+			size_t n = headers_.size();
+			size_t step = std::min(size - n, buffer_.size());
+			headers_.resize(n + step);
+			read_exact(headers_.data() + n, step, error);
+		}
+	};
+
+	using Dos = layout::DosHeader;
+	using Coff = layout::CoffHeader;
+	using Sec = layout::SectionHeader;
+
+	ensure(Dos::magic::end, 1);
+	if (Dos::magic::read(headers_.data()) != Dos::magic_value) throw 2;
+	ensure(Dos::size, 4);
+	size_t pe_header_offset = Dos::pe_header_offset::read(headers_.data());
+
+	ensure(pe_header_offset + Coff::signature::end, 6);
+	auto coff = [&] { return headers_.data() + pe_header_offset; };
+	if (Coff::signature::read(coff()) != Coff::signature_value) throw 7;
+	ensure(pe_header_offset + Coff::n_sections::end, 9);
+	uint16_t n_sections = Coff::n_sections::read(coff());
+	ensure(pe_header_offset + Coff::optional_header_size::end, 11);
+	uint16_t optheader_size = Coff::optional_header_size::read(coff());
+
+	size_t header_end = pe_header_offset + Coff::size + optheader_size;
+	ensure(header_end, 12);
+	ensure(header_end + Sec::size * n_sections, 13);
+
+	// The section table isn't part of the headers.
+	std::vector<unsigned char> table(headers_.begin() + header_end, headers_.end());
+	headers_.resize(header_end);
+
+	sections_.resize(n_sections);
+	for (size_t i = 0; i < n_sections; ++i) {
+		auto & section = sections_[i];
+		auto header = table.data() + i * Sec::size;
+		auto name = header + Sec::name::offset;
+		size_t name_size = 0;
+		while (name_size < Sec::name::size && name[name_size]) ++name_size;
+		section.name.assign(reinterpret_cast<char const *>(name), name_size);
+
+		section.virtual_size    = Sec::virtual_size::read(header);
+		section.virtual_address = Sec::virtual_address::read(header);
+		section.data_size       = Sec::data_size::read(header);
+		section.data_offset     = Sec::data_offset::read(header);
+
+		if (Sec::reloc_offset::read(header) != 0) throw 29;
+		if (Sec::lineno_offset::read(header) != 0) throw 30;
+		if (Sec::n_reloc::read(header) != 0) throw 31;
+		if (Sec::n_lineno::read(header) != 0) throw 32;
+
+		section.characteristics = Sec::characteristics::read(header);
+	}
+
+	// Empty sections first, since their offset doesn't matter.
+	order_.resize(n_sections);
+	for (size_t i = 0; i < n_sections; ++i) order_[i] = i;
+	std::stable_sort(order_.begin(), order_.end(), [this] (size_t a, size_t b) {
+		auto const & x = sections_[a];
+		auto const & y = sections_[b];
+		return (x.data_size ? x.data_offset : 0) < (y.data_size ? y.data_offset : 0);
+	});
+} catch (int error) {
+	throw_stream_error(error);
+}
+
+StreamReader::StreamReader(FILE * f, size_t buffer_size) : StreamReader(file_source(f), buffer_size) {}
+
+void StreamReader::read_exact(unsigned char * data, size_t size, int error) {
+	while (size > 0) {
+		size_t n = source_(data, size);
+		if (n == 0) throw error;
+		data += n;
+		size -= n;
+		offset_ += n;
+	}
+}
+
+void StreamReader::skip(uint64_t size, int error) {
+	while (size > 0) {
+		size_t n = std::min<uint64_t>(size, buffer_.size());
+		read_exact(buffer_.data(), n, error);
+		size -= n;
+	}
+}
+
+size_t StreamReader::next_section() try {
+	skip(remaining_, 25);
+	remaining_ = 0;
+	if (next_ == order_.size()) return npos;
+	size_t i = order_[next_++];
+	auto const & section = sections_[i];
+	if (section.data_size > 0) {
+		// Overlapping sections, or data within the headers.
+		if (section.data_offset < offset_) throw 33;
+		skip(section.data_offset - offset_, 24);
+		remaining_ = section.data_size;
+	}
+	return i;
+} catch (int error) {
+	throw_stream_error(error);
+}
+
+mstd::range<unsigned char const> StreamReader::read() try {
+	size_t n = std::min<size_t>(remaining_, buffer_.size());
+	if (n == 0) return {};
+	read_exact(buffer_.data(), n, 25);
+	remaining_ -= n;
+	return {buffer_.data(), n};
+} catch (int error) {
+	throw_stream_error(error);
+}
+
+PortableExecutable read_pe_stream(FILE * f) {
+	return read_pe_stream(file_source(f));
+}
+
+PortableExecutable read_pe_stream(StreamSource source) {
+	PortableExecutable pe;
+	std::vector<std::vector<unsigned char>> data;
+	read_pe_stream(std::move(source), [&] (StreamReader const & reader) {
+		pe.headers = reader.headers();
+		pe.sections.resize(reader.sections().size());
+		data.resize(reader.sections().size());
+		for (size_t i = 0; i < pe.sections.size(); ++i) {
+			auto const & s = reader.sections()[i];
+			auto & section = pe.sections[i];
+			section.name            = s.name;
+			section.virtual_size    = s.virtual_size;
+			section.virtual_address = s.virtual_address;
+			section.characteristics = s.characteristics;
+		}
+	}, [&] (size_t section, mstd::range<unsigned char const> d) {
+		// Not reserved up front: the sizes in the headers aren't checked
+		// against the length of the stream until the data arrives.
+		data[section].insert(data[section].end(), d.begin(), d.end());
+	});
+	for (size_t i = 0; i < pe.sections.size(); ++i) {
+		pe.sections[i].data = std::move(data[i]);
+	}
+	return pe;
+}
+
+void read_pe_stream(
+	StreamSource source,
+	std::function<void (StreamReader const & reader)> const & on_headers,
+	std::function<void (size_t section, mstd::range<unsigned char const> data)> const & on_data,
+	size_t buffer_size
+) {
+	StreamReader reader(std::move(source), buffer_size);
+	on_headers(reader);
+	size_t section;
+	while ((section = reader.next_section()) != StreamReader::npos) {
+		while (true) {
+			auto data = reader.read();
+			if (data.empty()) break;
+			on_data(section, data);
+		}
+	}
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe.hpp"
+
+namespace PE {
+
+// Reads up to size bytes into buffer, and returns the number of bytes read.
+// Returns zero only at the end of the stream.
+using StreamSource = std::function<size_t (unsigned char * buffer, size_t size)>;
+
+// A section header, as read by StreamReader before the section data.
+struct StreamSection {
+	std::string name;
+	uint32_t virtual_size;
+	uint32_t virtual_address;
+	uint32_t characteristics;
+	uint32_t data_offset;
+	uint32_t data_size;
+};
+
+// Reads a PE file in a single forward pass, without seeking, so it can read
+// from a pipe, a decompressor or an archive.
+//
+// The headers are read when the reader is constructed, into a buffer that
+// only grows as their bytes arrive, whatever the offsets in them say. After
+// that, the data of the sections is read in order of file offset:
+// next_section() skips ahead to the next section, and read() gives its data in
+// pieces of at most buffer_size bytes, all in the same buffer. Nothing else is
+// buffered.
+//
+// Section data that overlaps or comes before the end of the section table
+// can't be read without going back, and is an error. Anything after the last
+// section isn't read.
+class StreamReader {
+public:
+	static constexpr size_t npos = size_t(-1);
+	static constexpr size_t default_buffer_size = size_t(64) << 10;
+
+	explicit StreamReader(StreamSource, size_t buffer_size = default_buffer_size);
+	explicit StreamReader(FILE *, size_t buffer_size = default_buffer_size);
+
+	// The same as PortableExecutable::headers.
+	std::vector<unsigned char> const & headers() const { return headers_; }
+
+	// In the order of the section table.
+	std::vector<StreamSection> const & sections() const { return sections_; }
+
+	// Skip to the data of the next section in file order, and return its
+	// index in sections(), or npos if all sections were read. Whatever wasn't
+	// read of the current section is skipped.
+	size_t next_section();
+
+	// The next piece of the data of the current section, or an empty range
+	// if all of it was read. Valid until the next call.
+	mstd::range<unsigned char const> read();
+
+	// The offset in the file up to which everything was read.
+	uint64_t offset() const { return offset_; }
+
+private:
+	void read_exact(unsigned char * data, size_t size, int error);
+	void skip(uint64_t size, int error);
+
+	StreamSource source_;
+	std::vector<unsigned char> buffer_;
+	std::vector<unsigned char> headers_;
+	std::vector<StreamSection> sections_;
+	std::vector<size_t> order_; // Of sections_, by data_offset.
+	size_t next_ = 0; // In order_.
+	uint32_t remaining_ = 0; // Of the current section.
+	uint64_t offset_ = 0;
+};
+
+// Read a PE file in a single pass with a StreamReader, e.g. from a pipe. The
+// result is the same as that of read_pe_file.
+PortableExecutable read_pe_stream(FILE *);
+PortableExecutable read_pe_stream(StreamSource);
+
+// Read a PE file in a single pass, passing the headers to on_headers first,
+// and then every piece of section data to on_data, with the index of its
+// section in reader.sections().
+void read_pe_stream(
+	StreamSource,
+	std::function<void (StreamReader const & reader)> const & on_headers,
+	std::function<void (size_t section, mstd::range<unsigned char const> data)> const & on_data,
+	size_t buffer_size = StreamReader::default_buffer_size
+);
+
+}
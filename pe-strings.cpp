@@ -0,0 +1,109 @@
+#include <stdexcept>
+#include <string>
+
+#include "pe-bytes.hpp"
+#include "pe-strings.hpp"
+#include "pe-utf.hpp"
+
+namespace PE {
+
+namespace {
+
+// String IDs are 16-bit.
+constexpr uint32_t max_bundle = 0x10000 / 16;
+
+}
+
+constexpr uint32_t StringTable::any_language;
+
+StringTable::StringTable(ResourceTable const & resources, uint32_t language) try {
+	uint32_t previous = 0;
+	for (auto const & entry : resources.find(6)) {
+		if (entry.name.is_name() || entry.lang.is_name()) continue;
+		uint32_t name = entry.name.value;
+		if (name == 0 || name > max_bundle) continue;
+		if (language == any_language ? name == previous : entry.lang.value != language) continue;
+		previous = name;
+
+		if (bundles_.size() <= name) bundles_.resize(name + 1, 0);
+		bundles_[name] = strings_.size() / 16 + 1;
+		auto data = entry.data;
+		for (int i = 0; i < 16; ++i) {
+			size_t length = read_uint16(data, 1);
+			strings_.push_back(read_data(data, length * 2, 2));
+		}
+	}
+} catch (int error) {
+	throw std::runtime_error("Unable to parse string table. (Error " + std::to_string(error) + ")");
+}
+
+std::u16string StringTable::string(uint32_t id) const {
+	auto s = find(id);
+	std::u16string result(s.size() / 2, 0);
+	for (size_t i = 0; i < result.size(); ++i) result[i] = load_le<uint16_t>(s.data() + 2 * i);
+	return result;
+}
+
+std::string StringTable::utf8(uint32_t id) const {
+	return to_utf8(find(id));
+}
+
+std::map<uint16_t, std::u16string> StringTable::to_map() const {
+	std::map<uint16_t, std::u16string> strings;
+	for (uint32_t name = 1; name < bundles_.size(); ++name) {
+		if (!bundles_[name]) continue;
+		for (uint32_t i = 0; i < 16; ++i) {
+			uint32_t id = (name - 1) * 16 + i;
+			if (!find(id).empty()) strings.emplace_hint(strings.end(), id, string(id));
+		}
+	}
+	return strings;
+}
+
+std::vector<StringBundle> serialize_string_table(std::map<uint16_t, std::u16string> const & strings) {
+	std::vector<StringBundle> bundles;
+	auto i = strings.begin();
+	while (i != strings.end()) {
+		uint32_t name = i->first / 16 + 1;
+		auto end = i;
+		size_t size = 16 * 2;
+		for (; end != strings.end() && end->first / 16 + 1u == name; ++end) {
+			if (end->second.size() > 0xFFFF) throw std::runtime_error("Unable to serialize string table. (String too long)");
+			size += end->second.size() * 2;
+		}
+		if (size > 16 * 2) {
+			bundles.push_back({uint16_t(name), std::vector<unsigned char>(size, 0)});
+			unsigned char * out = bundles.back().data.data();
+			for (uint32_t slot = 0; slot < 16; ++slot) {
+				if (i != end && i->first % 16 == slot) {
+					auto const & s = i->second;
+					write_uint16(out, s.size());
+					for (size_t j = 0; j < s.size(); ++j) write_uint16(out + 2 + 2 * j, s[j]);
+					out += 2 + 2 * s.size();
+					++i;
+				} else {
+					out += 2; // Zero length.
+				}
+			}
+		}
+		i = end;
+	}
+	return bundles;
+}
+
+void set_string_table(
+	std::map<ResourceId, mstd::range<unsigned char const>> & resources,
+	std::vector<StringBundle> const & bundles,
+	uint32_t language
+) {
+	auto lang = from_number(language);
+	for (auto i = resources.begin(); i != resources.end();) {
+		if (i->first.type == u"6" && i->first.lang == lang) i = resources.erase(i);
+		else ++i;
+	}
+	for (auto const & b : bundles) {
+		resources[ResourceId(u"6", from_number(b.name), lang)] = b.data;
+	}
+}
+
+}
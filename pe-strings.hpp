@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe-res.hpp"
+
+namespace PE {
+
+// The string table of a resource section: the string resources (type 6) of
+// one language.
+//
+// Strings are stored in bundles of 16: string ID i is string i % 16 of the
+// resource named i / 16 + 1, as a 16-bit length followed by that many UTF-16LE
+// characters. The bundles are read once, when the table is made, after which
+// finding a string is only a matter of indexing two arrays.
+//
+// Nothing is copied: strings refer to the resource section, which must
+// outlive the table.
+class StringTable {
+public:
+	// Take the first language of every bundle.
+	static constexpr uint32_t any_language = 0xFFFFFFFF;
+
+	StringTable() {}
+
+	// Throws if a bundle is malformed.
+	explicit StringTable(ResourceTable const &, uint32_t language = any_language);
+
+	// The UTF-16LE characters of a string, without length or terminating
+	// null. Empty if there is no such string: string tables don't
+	// distinguish empty strings from missing ones.
+	mstd::range<unsigned char const> find(uint32_t id) const {
+		uint32_t bundle = id / 16 + 1;
+		if (bundle >= bundles_.size() || !bundles_[bundle]) return {};
+		return strings_[(bundles_[bundle] - 1) * 16 + id % 16];
+	}
+
+	std::u16string string(uint32_t id) const;
+	std::string utf8(uint32_t id) const;
+
+	// The number of bundles.
+	size_t n_bundles() const { return strings_.size() / 16; }
+
+	// All non-empty strings, by ID, e.g. to change some and serialize them again.
+	std::map<uint16_t, std::u16string> to_map() const;
+
+private:
+	// Per resource name, 1 + the index of the bundle in strings_, or 0.
+	std::vector<uint32_t> bundles_;
+
+	// 16 per bundle.
+	std::vector<mstd::range<unsigned char const>> strings_;
+};
+
+// One string table resource.
+struct StringBundle {
+	uint16_t name; // 1 + the IDs of the strings / 16.
+	std::vector<unsigned char> data;
+};
+
+// Serialize strings, by ID, into bundles, in order of name. Bundles of only
+// empty strings are left out.
+std::vector<StringBundle> serialize_string_table(std::map<uint16_t, std::u16string> const & strings);
+
+// Replace all string resources of a language by the given bundles, which must
+// outlive the resources.
+void set_string_table(
+	std::map<ResourceId, mstd::range<unsigned char const>> & resources,
+	std::vector<StringBundle> const & bundles,
+	uint32_t language
+);
+
+}
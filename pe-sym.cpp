@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "pe-bytes.hpp"
+#include "pe-sym.hpp"
+
+namespace PE {
+
+namespace {
+
+// The null terminated string at the RVA, without the null.
+mstd::range<char const> read_string(AddressMap const & addresses, uint32_t rva, int error) {
+	auto data = addresses.data(rva);
+	if (data.empty()) throw error;
+	auto end = static_cast<unsigned char const *>(std::memchr(data.data(), 0, data.size()));
+	if (!end) throw error;
+	return {reinterpret_cast<char const *>(data.data()), size_t(end - data.data())};
+}
+
+uint32_t uint32_at(mstd::range<unsigned char const> data, size_t i) {
+	auto p = data.data() + 4 * i;
+	return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+uint16_t uint16_at(mstd::range<unsigned char const> data, size_t i) {
+	auto p = data.data() + 2 * i;
+	return p[0] | p[1] << 8;
+}
+
+int compare(mstd::range<char const> a, mstd::range<char const> b) {
+	size_t n = std::min(a.size(), b.size());
+	if (int x = n ? std::memcmp(a.data(), b.data(), n) : 0) return x;
+	return a.size() < b.size() ? -1 : a.size() > b.size();
+}
+
+bool equal_ignoring_case(mstd::range<char const> a, char const * b) {
+	for (char c : a) {
+		char d = *b++;
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		if (d >= 'A' && d <= 'Z') d += 'a' - 'A';
+		if (c != d) return false;
+	}
+	return *b == 0;
+}
+
+[[noreturn]] void throw_export_error(int error) {
+	throw std::runtime_error("Unable to parse export table. (Error " + std::to_string(error) + ")");
+}
+
+}
+
+ExportTable::ExportTable(ImageHeaders const & headers, AddressMap const & addresses) try : addresses_(addresses) {
+	directory_ = headers.data_directory(export_directory);
+	if (directory_.virtual_address == 0) return;
+
+	auto data = addresses_.data(directory_.virtual_address, 40);
+	if (data.empty()) throw 1;
+
+	read_data(data, 12, 2); // Characteristics, TimeDateStamp, MajorVersion, MinorVersion.
+	uint32_t name_rva         = read_uint32(data, 3);
+	ordinal_base_             = read_uint32(data, 4);
+	uint32_t n_functions      = read_uint32(data, 5);
+	uint32_t n_names          = read_uint32(data, 6);
+	uint32_t functions_rva    = read_uint32(data, 7);
+	uint32_t names_rva        = read_uint32(data, 8);
+	uint32_t ordinals_rva     = read_uint32(data, 9);
+
+	if (name_rva) dll_name_ = read_string(addresses_, name_rva, 10);
+
+	functions_ = addresses_.data(functions_rva, size_t(n_functions) * 4);
+	if (functions_.size() != size_t(n_functions) * 4) throw 11;
+	names_ = addresses_.data(names_rva, size_t(n_names) * 4);
+	if (names_.size() != size_t(n_names) * 4) throw 12;
+	ordinals_ = addresses_.data(ordinals_rva, size_t(n_names) * 2);
+	if (ordinals_.size() != size_t(n_names) * 2) throw 13;
+} catch (int error) {
+	throw_export_error(error);
+}
+
+ExportTable::ExportTable(PortableExecutable const & pe) : ExportTable(ImageHeaders(pe.headers), AddressMap(pe)) {}
+
+ExportTable::ExportTable(ImageView const & image) : ExportTable(ImageHeaders(image.headers), AddressMap(image)) {}
+
+mstd::range<char const> ExportTable::string(uint32_t rva) const try {
+	return read_string(addresses_, rva, 14);
+} catch (int error) {
+	throw_export_error(error);
+}
+
+ExportTable::Export ExportTable::function(uint32_t index) const {
+	Export e;
+	if (index >= n_functions()) return e;
+	e.rva = uint32_at(functions_, index);
+	if (e.rva == 0) return e;
+	e.ordinal = ordinal_base_ + index;
+	if (e.rva - directory_.virtual_address < directory_.size) e.forwarder = string(e.rva);
+	return e;
+}
+
+ExportTable::Export ExportTable::named_export(size_t i) const {
+	if (i >= n_names()) return Export();
+	auto e = function(uint16_at(ordinals_, i));
+	e.name = string(uint32_at(names_, i));
+	return e;
+}
+
+ExportTable::Export ExportTable::find(mstd::range<char const> name) const {
+	size_t begin = 0;
+	size_t end = n_names();
+	while (begin < end) {
+		size_t i = begin + (end - begin) / 2;
+		int x = compare(string(uint32_at(names_, i)), name);
+		if (x == 0) return named_export(i);
+		if (x < 0) begin = i + 1;
+		else end = i;
+	}
+	return Export();
+}
+
+ExportTable::Export ExportTable::find(char const * name) const {
+	return find(mstd::range<char const>(name, std::strlen(name)));
+}
+
+ExportTable::Export ExportTable::find_ordinal(uint32_t ordinal) const {
+	return function(ordinal - ordinal_base_);
+}
+
+ImportTable::ImportTable(ImageHeaders const & headers, AddressMap const & addresses) try {
+	auto directory = headers.data_directory(import_directory);
+	if (directory.virtual_address == 0) return;
+
+	size_t const thunk_size = headers.is_pe32_plus() ? 8 : 4;
+
+	// The directory ends with an empty descriptor. Its size in the data
+	// directory isn't always right, so it's not used.
+	auto descriptors = addresses.data(directory.virtual_address);
+	while (true) {
+		auto descriptor = read_data(descriptors, 20, 1);
+		uint32_t lookup_rva = read_uint32(descriptor, 2);
+		read_data(descriptor, 8, 2); // TimeDateStamp, ForwarderChain.
+		uint32_t name_rva = read_uint32(descriptor, 2);
+		uint32_t iat_rva = read_uint32(descriptor, 2);
+		if (name_rva == 0 && iat_rva == 0) break;
+
+		Dll dll;
+		dll.name = read_string(addresses, name_rva, 3);
+		dll.first_import = imports_.size();
+
+		// Without a lookup table, the import address table (which is the
+		// same before binding) is used instead.
+		uint32_t thunk_rva = lookup_rva ? lookup_rva : iat_rva;
+		auto thunks = addresses.data(thunk_rva);
+		for (uint32_t i = 0; ; ++i) {
+			auto thunk = read_data(thunks, thunk_size, 4);
+			uint64_t value = read_uint32(thunk, 4);
+			if (thunk_size == 8) value |= uint64_t(read_uint32(thunk, 4)) << 32;
+			if (value == 0) break;
+
+			Import import;
+			import.iat_rva = iat_rva + i * thunk_size;
+			if (value >> (thunk_size * 8 - 1)) {
+				import.ordinal = value & 0xFFFF;
+			} else {
+				auto hint = addresses.data(value & 0x7FFFFFFF, 2);
+				if (hint.empty()) throw 5;
+				import.hint = hint[0] | hint[1] << 8;
+				import.name = read_string(addresses, (value & 0x7FFFFFFF) + 2, 6);
+			}
+			imports_.push_back(import);
+		}
+
+		dll.n_imports = imports_.size() - dll.first_import;
+		dlls_.push_back(dll);
+	}
+} catch (int error) {
+	throw std::runtime_error("Unable to parse import table. (Error " + std::to_string(error) + ")");
+}
+
+ImportTable::ImportTable(PortableExecutable const & pe) : ImportTable(ImageHeaders(pe.headers), AddressMap(pe)) {}
+
+ImportTable::ImportTable(ImageView const & image) : ImportTable(ImageHeaders(image.headers), AddressMap(image)) {}
+
+ImportTable::Dll const * ImportTable::find(char const * dll_name) const {
+	for (auto const & dll : dlls_) {
+		if (equal_ignoring_case(dll.name, dll_name)) return &dll;
+	}
+	return nullptr;
+}
+
+ImportTable::Import const * ImportTable::find(char const * dll_name, char const * function_name) const {
+	mstd::range<char const> name(function_name, std::strlen(function_name));
+	for (auto const & dll : dlls_) {
+		if (!equal_ignoring_case(dll.name, dll_name)) continue;
+		for (auto const & import : imports(dll)) {
+			if (!import.name.empty() && compare(import.name, name) == 0) return &import;
+		}
+	}
+	return nullptr;
+}
+
+}
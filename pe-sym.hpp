@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <mstd/range.hpp>
+
+#include "pe-headers.hpp"
+#include "pe.hpp"
+
+namespace PE {
+
+// The export directory of a PE file.
+//
+// Nothing is copied: names refer to the section data, which must outlive the
+// table. Only the location of the tables is checked up front. Exports are
+// read from the section data when asked for.
+class ExportTable {
+public:
+	struct Export {
+		// False for the export returned by find() or find_ordinal() if
+		// nothing was found.
+		explicit operator bool () const { return ordinal != 0 || rva != 0; }
+
+		mstd::range<char const> name; // Empty if only exported by ordinal.
+		uint32_t ordinal = 0;
+		uint32_t rva = 0;
+
+		// A forwarder (e.g. "NTDLL.RtlAllocateHeap") instead of a function,
+		// if the RVA points into the export directory itself.
+		mstd::range<char const> forwarder;
+	};
+
+	ExportTable() {}
+
+	// Empty if there is no export directory. Throws if it's malformed.
+	ExportTable(ImageHeaders const &, AddressMap const &);
+	explicit ExportTable(PortableExecutable const &);
+	explicit ExportTable(ImageView const &);
+
+	mstd::range<char const> dll_name() const { return dll_name_; }
+	uint32_t ordinal_base() const { return ordinal_base_; }
+
+	size_t n_functions() const { return functions_.size() / 4; }
+	size_t n_names() const { return names_.size() / 4; }
+
+	// The named exports, in the order of the export name table, which is
+	// sorted by name. Empty if i is out of range.
+	Export named_export(size_t i) const;
+
+	// Find an export by name, with a binary search over the export name table.
+	// (The loader relies on that table being sorted as well.)
+	Export find(mstd::range<char const> name) const;
+	Export find(char const * name) const;
+
+	// Find an export by ordinal. Its name is not looked up.
+	Export find_ordinal(uint32_t ordinal) const;
+
+private:
+	mstd::range<char const> string(uint32_t rva) const;
+	Export function(uint32_t index) const;
+
+	AddressMap addresses_;
+	DataDirectory directory_ = {0, 0};
+	mstd::range<char const> dll_name_;
+	uint32_t ordinal_base_ = 0;
+	mstd::range<unsigned char const> functions_;
+	mstd::range<unsigned char const> names_;
+	mstd::range<unsigned char const> ordinals_;
+};
+
+// The import directory of a PE file, as one flat array of all imported
+// functions, grouped per DLL.
+//
+// Nothing is copied: names refer to the section data, which must outlive the
+// table.
+class ImportTable {
+public:
+	struct Import {
+		mstd::range<char const> name; // Empty if imported by ordinal.
+		uint16_t hint = 0; // Only if imported by name.
+		uint16_t ordinal = 0; // Only if imported by ordinal.
+		uint32_t iat_rva = 0; // The address of the import address table entry.
+	};
+
+	struct Dll {
+		mstd::range<char const> name;
+		size_t first_import;
+		size_t n_imports;
+	};
+
+	ImportTable() {}
+
+	// Empty if there is no import directory. Throws if it's malformed.
+	ImportTable(ImageHeaders const &, AddressMap const &);
+	explicit ImportTable(PortableExecutable const &);
+	explicit ImportTable(ImageView const &);
+
+	std::vector<Dll> const & dlls() const { return dlls_; }
+	std::vector<Import> const & imports() const { return imports_; }
+
+	mstd::range<Import const> imports(Dll const & dll) const {
+		return {imports_.data() + dll.first_import, dll.n_imports};
+	}
+
+	// The DLL with the given name, ignoring (ASCII) case like the loader, or null.
+	Dll const * find(char const * dll_name) const;
+
+	// The function imported by name from the given DLL, or null.
+	Import const * find(char const * dll_name, char const * function_name) const;
+
+private:
+	std::vector<Dll> dlls_;
+	std::vector<Import> imports_;
+};
+
+}
@@ -0,0 +1,270 @@
+#include <cstdint>
+
+#if !defined(PE_UTF_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PE_UTF_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(PE_UTF_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PE_UTF_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "pe-layout.hpp"
+#include "pe-utf.hpp"
+
+namespace PE {
+
+namespace {
+
+// The kernels transcode the ASCII characters at the start of the input, up
+// to the first other character, and return how many they did.
+
+size_t encode_ascii_scalar(unsigned char const * p, size_t n, char * out) {
+	size_t i = 0;
+	for (; i < n && p[2 * i] < 0x80 && p[2 * i + 1] == 0; ++i) out[i] = char(p[2 * i]);
+	return i;
+}
+
+size_t decode_ascii_scalar(char const * s, size_t n, char16_t * out) {
+	size_t i = 0;
+	for (; i < n && static_cast<unsigned char>(s[i]) < 0x80; ++i) out[i] = s[i];
+	return i;
+}
+
+#ifdef PE_UTF_SSE2
+size_t encode_ascii_sse2(unsigned char const * p, size_t n, char * out) {
+	__m128i const zero = _mm_setzero_si128();
+	__m128i const non_ascii = _mm_set1_epi16(short(0xFF80));
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + 2 * i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) != 0xFFFF) break;
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(v, v));
+	}
+	return i + encode_ascii_scalar(p + 2 * i, n - i, out + i);
+}
+
+size_t decode_ascii_sse2(char const * s, size_t n, char16_t * out) {
+	__m128i const zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i));
+		if (_mm_movemask_epi8(v)) break;
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 8), _mm_unpackhi_epi8(v, zero));
+	}
+	return i + decode_ascii_scalar(s + i, n - i, out + i);
+}
+#endif
+
+#ifdef PE_UTF_AVX2
+__attribute__((target("avx2")))
+size_t encode_ascii_avx2(unsigned char const * p, size_t n, char * out) {
+	__m256i const non_ascii = _mm256_set1_epi16(short(0xFF80));
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p + 2 * i));
+		if (!_mm256_testz_si256(v, non_ascii)) break;
+		// packus works per 128-bit lane, so gather the low halves of both lanes.
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm256_castsi256_si128(packed));
+	}
+	return i + encode_ascii_sse2(p + 2 * i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+size_t decode_ascii_avx2(char const * s, size_t n, char16_t * out) {
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i));
+		if (_mm256_movemask_epi8(v)) break;
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+	}
+	return i + decode_ascii_sse2(s + i, n - i, out + i);
+}
+#endif
+
+struct Kernels {
+	size_t (*encode_ascii)(unsigned char const *, size_t, char *);
+	size_t (*decode_ascii)(char const *, size_t, char16_t *);
+};
+
+Kernels select_kernels() {
+#ifdef PE_UTF_AVX2
+	if (__builtin_cpu_supports("avx2")) return {encode_ascii_avx2, decode_ascii_avx2};
+#endif
+#ifdef PE_UTF_SSE2
+	return {encode_ascii_sse2, decode_ascii_sse2};
+#else
+	return {encode_ascii_scalar, decode_ascii_scalar};
+#endif
+}
+
+Kernels const & kernels() {
+	static Kernels const k = select_kernels();
+	return k;
+}
+
+// Decode the non-ASCII sequence at the start of the n bytes at s, and set
+// length to the number of bytes it takes. Invalid sequences are one byte,
+// which decodes as U+FFFD.
+uint32_t decode_sequence(unsigned char const * s, size_t n, size_t & length) {
+	auto continues = [&] (size_t i) { return i < n && (s[i] & 0xC0) == 0x80; };
+	uint32_t c = s[0];
+	length = 1;
+	if (c >= 0xC2 && c < 0xE0 && continues(1)) {
+		length = 2;
+		return (c & 0x1F) << 6 | (s[1] & 0x3F);
+	}
+	if (c >= 0xE0 && c < 0xF0 && continues(1) && continues(2)) {
+		uint32_t x = (c & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+		if (x >= 0x800) {
+			length = 3;
+			return x;
+		}
+	}
+	if (c >= 0xF0 && c < 0xF5 && continues(1) && continues(2) && continues(3)) {
+		uint32_t x = (c & 0x07) << 18 | (s[1] & 0x3F) << 12 | (s[2] & 0x3F) << 6 | (s[3] & 0x3F);
+		if (x >= 0x10000 && x < 0x110000) {
+			length = 4;
+			return x;
+		}
+	}
+	return 0xFFFD;
+}
+
+}
+
+size_t utf16_to_utf8(mstd::range<unsigned char const> utf16le, char * out) {
+	auto encode_ascii = kernels().encode_ascii;
+	unsigned char const * p = utf16le.data();
+	size_t n = utf16le.size() / 2;
+	char * o = out;
+	size_t i = 0;
+	while (i < n) {
+		size_t n_ascii = encode_ascii(p + 2 * i, n - i, o);
+		i += n_ascii;
+		o += n_ascii;
+
+		// Everything up to the next ASCII character.
+		while (i < n) {
+			uint32_t c = load_le<uint16_t>(p + 2 * i);
+			if (c < 0x80) break;
+			++i;
+			if (c < 0x800) {
+				*o++ = char(0xC0 | c >> 6);
+				*o++ = char(0x80 | (c & 0x3F));
+				continue;
+			}
+			if (c >= 0xD800 && c < 0xDC00 && i < n) {
+				uint32_t low = load_le<uint16_t>(p + 2 * i);
+				if (low >= 0xDC00 && low < 0xE000) {
+					++i;
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+					*o++ = char(0xF0 | c >> 18);
+					*o++ = char(0x80 | (c >> 12 & 0x3F));
+					*o++ = char(0x80 | (c >> 6 & 0x3F));
+					*o++ = char(0x80 | (c & 0x3F));
+					continue;
+				}
+			}
+			// Including unpaired surrogates.
+			*o++ = char(0xE0 | c >> 12);
+			*o++ = char(0x80 | (c >> 6 & 0x3F));
+			*o++ = char(0x80 | (c & 0x3F));
+		}
+	}
+	return o - out;
+}
+
+void append_utf8(std::string & out, mstd::range<unsigned char const> utf16le) {
+	size_t size = out.size();
+	out.resize(size + max_utf8_size(utf16le.size() / 2));
+	out.resize(size + utf16_to_utf8(utf16le, &out[size]));
+}
+
+std::string to_utf8(mstd::range<unsigned char const> utf16le) {
+	std::string s;
+	append_utf8(s, utf16le);
+	return s;
+}
+
+std::string to_utf8(std::u16string const & s) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	std::string bytes(s.size() * 2, 0);
+	for (size_t i = 0; i < s.size(); ++i) store_le<uint16_t>(reinterpret_cast<unsigned char *>(&bytes[2 * i]), s[i]);
+	return to_utf8(mstd::range<unsigned char const>(reinterpret_cast<unsigned char const *>(bytes.data()), bytes.size()));
+#else
+	return to_utf8(mstd::range<unsigned char const>(reinterpret_cast<unsigned char const *>(s.data()), s.size() * 2));
+#endif
+}
+
+size_t utf8_to_utf16(mstd::range<char const> utf8, char16_t * out) {
+	auto decode_ascii = kernels().decode_ascii;
+	auto s = reinterpret_cast<unsigned char const *>(utf8.data());
+	size_t n = utf8.size();
+	char16_t * o = out;
+	size_t i = 0;
+	while (i < n) {
+		size_t n_ascii = decode_ascii(utf8.data() + i, n - i, o);
+		i += n_ascii;
+		o += n_ascii;
+
+		// Everything up to the next ASCII character.
+		while (i < n && s[i] >= 0x80) {
+			size_t length;
+			uint32_t c = decode_sequence(s + i, n - i, length);
+			i += length;
+			if (c < 0x10000) {
+				*o++ = char16_t(c);
+			} else {
+				c -= 0x10000;
+				*o++ = char16_t(0xD800 + (c >> 10));
+				*o++ = char16_t(0xDC00 + (c & 0x3FF));
+			}
+		}
+	}
+	return o - out;
+}
+
+std::u16string to_utf16(mstd::range<char const> utf8) {
+	std::u16string s(utf8.size(), 0);
+	s.resize(utf8_to_utf16(utf8, &s[0]));
+	return s;
+}
+
+std::u16string to_utf16(std::string const & s) {
+	return to_utf16(mstd::range<char const>(s.data(), s.size()));
+}
+
+char const * check_utf_kernels(mstd::range<unsigned char const> utf16le, mstd::range<char const> utf8) {
+#ifdef PE_UTF_SSE2
+	unsigned char const * p = utf16le.data();
+	size_t n = utf16le.size() / 2;
+	std::string expected_utf8(n, 0), utf8_out(n, 0);
+	std::u16string expected_utf16(utf8.size(), 0), utf16_out(utf8.size(), 0);
+	size_t n_encoded = encode_ascii_scalar(p, n, &expected_utf8[0]);
+	size_t n_decoded = decode_ascii_scalar(utf8.data(), utf8.size(), &expected_utf16[0]);
+
+	auto agrees = [&] (Kernels k) {
+		return
+			k.encode_ascii(p, n, &utf8_out[0]) == n_encoded &&
+			utf8_out.compare(0, n_encoded, expected_utf8, 0, n_encoded) == 0 &&
+			k.decode_ascii(utf8.data(), utf8.size(), &utf16_out[0]) == n_decoded &&
+			utf16_out.compare(0, n_decoded, expected_utf16, 0, n_decoded) == 0;
+	};
+	if (!agrees({encode_ascii_sse2, decode_ascii_sse2})) return "sse2";
+#ifdef PE_UTF_AVX2
+	if (__builtin_cpu_supports("avx2") && !agrees({encode_ascii_avx2, decode_ascii_avx2})) return "avx2";
+#endif
+#else
+	// There's only the portable code.
+	(void)utf16le;
+	(void)utf8;
+#endif
+	return nullptr;
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <mstd/range.hpp>
+
+// Transcoding between UTF-16LE, as used for all names and strings in resource
+// sections and version information, and UTF-8.
+//
+// Unpaired surrogates are kept, as three bytes each (as in WTF-8), so any
+// UTF-16 string survives a round trip through UTF-8. Bytes that aren't valid
+// UTF-8 are decoded as U+FFFD.
+//
+// Runs of ASCII are transcoded with SSE2 or AVX2 where available.
+
+namespace PE {
+
+// The most UTF-8 bytes n UTF-16 code units can become.
+constexpr size_t max_utf8_size(size_t n_units) { return n_units * 3; }
+
+// Transcode UTF-16LE bytes into out, which must have room for
+// max_utf8_size(utf16le.size() / 2) bytes, and return the number of bytes
+// written. A last odd byte is ignored.
+size_t utf16_to_utf8(mstd::range<unsigned char const> utf16le, char * out);
+
+// Transcode UTF-16LE bytes and append them to out, reusing its memory.
+void append_utf8(std::string & out, mstd::range<unsigned char const> utf16le);
+
+std::string to_utf8(mstd::range<unsigned char const> utf16le);
+std::string to_utf8(std::u16string const &);
+
+// Transcode UTF-8 into out, which must have room for utf8.size() code units,
+// and return the number of code units written.
+size_t utf8_to_utf16(mstd::range<char const> utf8, char16_t * out);
+
+std::u16string to_utf16(mstd::range<char const> utf8);
+std::u16string to_utf16(std::string const &);
+
+// Compare the SIMD code this CPU supports with the portable code on the
+// given input, in both directions, e.g. to test it. Returns the name of the
+// first kernel that gives a different result ("sse2" or "avx2"), or null if
+// they all agree.
+char const * check_utf_kernels(mstd::range<unsigned char const> utf16le, mstd::range<char const> utf8);
+
+}
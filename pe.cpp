@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
@@ -5,48 +6,138 @@
 #include <string>
 #include <vector>
 
+#ifndef WIN32
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define PE_HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+#include <mstd/range.hpp>
+
+#include "pe-bytes.hpp"
+#include "pe-checksum.hpp"
+#include "pe-headers.hpp"
+#include "pe-instrument.hpp"
+#include "pe-layout.hpp"
+#include "pe-map.hpp"
+#include "pe-plan.hpp"
 #include "pe.hpp"
 
 namespace PE {
 
+std::vector<unsigned char> & SectionData::edit() {
+	if (is_view_) {
+		owned_.assign(view_.begin(), view_.end());
+		view_ = {};
+		source_.reset();
+		is_view_ = false;
+	}
+	return owned_;
+}
+
 namespace {
 
-void read_data(FILE * f, unsigned char * buf, size_t n_bytes, int error) {
-	int s = fread(buf, n_bytes, 1, f);
-	if (s < 0) throw std::runtime_error("Unable to read from file.");
-	if (s != 1) throw error;
-}
+// Reads from a file, keeping track of the offset for errors.
+struct FileReader {
+	FILE * f;
+	uint64_t offset;
+
+	bool read(unsigned char * buf, size_t n_bytes) {
+		PE_COUNT(io_calls, 1);
+		PE_COUNT(bytes_read, n_bytes);
+		if (fread(buf, n_bytes, 1, f) != 1) return false;
+		offset += n_bytes;
+		return true;
+	}
 
-uint32_t read_uint32(FILE * f, int error) {
-	unsigned char buf[4];
-	read_data(f, buf, 4, error);
-	return buf[0] | buf[1] << 8 | buf[2] << 16 | buf[3] << 24;
-}
+	// Returns the number of bytes read, which is less than n_bytes only at
+	// the end of the file.
+	size_t read_some(unsigned char * buf, size_t n_bytes) {
+		PE_COUNT(io_calls, 1);
+		size_t n = fread(buf, 1, n_bytes, f);
+		PE_COUNT(bytes_read, n);
+		offset += n;
+		return n;
+	}
 
-uint16_t read_uint16(FILE * f, int error) {
-	unsigned char buf[2];
-	read_data(f, buf, 2, error);
-	return buf[0] | buf[1] << 8;
-}
+	bool read_uint32(uint32_t & value) {
+		unsigned char buf[4];
+		if (!read(buf, 4)) return false;
+		value = load_le<uint32_t>(buf);
+		return true;
+	}
+
+	bool read_uint16(uint16_t & value) {
+		unsigned char buf[2];
+		if (!read(buf, 2)) return false;
+		value = load_le<uint16_t>(buf);
+		return true;
+	}
+
+	bool seek(uint64_t new_offset) {
+		if (fseek(f, new_offset, SEEK_SET) != 0) return false;
+		offset = new_offset;
+		return true;
+	}
+
+	// The size of the file. Leaves the position at the end.
+	bool size(uint64_t & size) {
+		if (fseek(f, 0, SEEK_END) != 0) return false;
+		long end = ftell(f);
+		if (end < 0) return false;
+		size = end;
+		return true;
+	}
+};
 
 void write_data(FILE * f, unsigned char const * buf, size_t n_bytes) {
+	PE_COUNT(io_calls, 1);
+	PE_COUNT(bytes_written, n_bytes);
 	if (fwrite(buf, n_bytes, 1, f) != 1) throw std::runtime_error("Unable to write to file.");
 }
 
-void write_uint16(FILE * f, uint16_t value) {
-	unsigned char buf[2];
-	buf[0] = value      & 0xFF;
-	buf[1] = value >> 8 & 0xFF;
-	write_data(f, buf, 2);
+// Check the first n bytes of a section header, which should be all of it.
+// Returns the error that reading its fields one by one would give, or 0.
+int check_section_header(unsigned char const * header, size_t n) {
+	using H = layout::SectionHeader;
+	if (n < H::name::end) return 13;
+	if (n < H::virtual_size::end) return 14;
+	if (n < H::virtual_address::end) return 15;
+	if (n < H::data_size::end) return 16;
+	if (n < H::data_offset::end) return 17;
+	if (n < H::reloc_offset::end) return 18;
+	if (H::reloc_offset::read(header) != 0) return 29;
+	if (n < H::lineno_offset::end) return 19;
+	if (H::lineno_offset::read(header) != 0) return 30;
+	if (n < H::n_reloc::end) return 20;
+	if (H::n_reloc::read(header) != 0) return 31;
+	if (n < H::n_lineno::end) return 21;
+	if (H::n_lineno::read(header) != 0) return 32;
+	if (n < H::characteristics::end) return 22;
+	return 0;
 }
 
-void write_uint32(FILE * f, uint32_t value) {
-	unsigned char buf[4];
-	buf[0] = value       & 0xFF;
-	buf[1] = value >>  8 & 0xFF;
-	buf[2] = value >> 16 & 0xFF;
-	buf[3] = value >> 24 & 0xFF;
-	write_data(f, buf, 4);
+// Decode a section header that was checked by check_section_header.
+template<typename S>
+void read_section_header(unsigned char const * header, S & section, uint32_t & data_size, uint32_t & data_offset) {
+	using H = layout::SectionHeader;
+	auto name = reinterpret_cast<char const *>(header + H::name::offset);
+	size_t name_size = 0;
+	while (name_size < H::name::size && name[name_size]) ++name_size;
+	section.name.assign(name, name_size);
+	section.virtual_size    = H::virtual_size::read(header);
+	section.virtual_address = H::virtual_address::read(header);
+	section.characteristics = H::characteristics::read(header);
+	data_size               = H::data_size::read(header);
+	data_offset             = H::data_offset::read(header);
 }
 
 size_t padding(size_t address, size_t align) {
@@ -56,181 +147,408 @@ size_t padding(size_t address, size_t align) {
 
 }
 
-PortableExecutable read_pe_file(FILE * f) try {
-	PortableExecutable pe;
-
-	if (read_uint16(f, 1) != 0x5a4d) throw 2;
-	if (fseek(f, 0x3C, SEEK_SET) != 0) throw 3;
-	uint32_t pe_header_offset = read_uint32(f, 4);
-	if (fseek(f, pe_header_offset, SEEK_SET) != 0) throw 5;
-	if (read_uint32(f, 6) != 0x00004550) throw 7;
-	if (fseek(f, 2, SEEK_CUR) != 0) throw 8;
-	uint16_t n_sections = read_uint16(f, 9);
-	if (fseek(f, 12, SEEK_CUR) != 0) throw 10;
-	uint16_t optheader_size = read_uint16(f, 11);
-	if (fseek(f, 2 + optheader_size, SEEK_CUR) != 0) throw 12;
-
-	int header_end = ftell(f);
-	if (header_end < 0) throw 27;
-	fseek(f, 0, SEEK_SET);
+Result<PortableExecutable> try_read_pe_file(FILE * f) {
+	using namespace layout;
+	PE_STAGE(read_pe_file);
+	FileReader r = {f, 0};
+	auto fail = [&] (int reason) { return Error{Stage::read_pe_file, reason, r.offset}; };
+
+	uint16_t mz, n_sections, optheader_size;
+	uint32_t pe_header_offset, signature;
+	if (!r.read_uint16(mz)) return fail(1);
+	if (mz != DosHeader::magic_value) return fail(2);
+	if (!r.seek(DosHeader::pe_header_offset::offset)) return fail(3);
+	if (!r.read_uint32(pe_header_offset)) return fail(4);
+	if (!r.seek(pe_header_offset)) return fail(5);
+	if (!r.read_uint32(signature)) return fail(6);
+	if (signature != CoffHeader::signature_value) return fail(7);
+	if (!r.seek(uint64_t(pe_header_offset) + CoffHeader::n_sections::offset)) return fail(8);
+	if (!r.read_uint16(n_sections)) return fail(9);
+	if (!r.seek(uint64_t(pe_header_offset) + CoffHeader::optional_header_size::offset)) return fail(10);
+	if (!r.read_uint16(optheader_size)) return fail(11);
+	if (!r.seek(uint64_t(pe_header_offset) + CoffHeader::size + optheader_size)) return fail(12);
+
+	size_t header_end = r.offset;
+	r.seek(0);
 
+	PortableExecutable pe;
 	pe.headers.resize(header_end);
-	read_data(f, pe.headers.data(), pe.headers.size(), 28);
+	if (!r.read(pe.headers.data(), pe.headers.size())) return fail(28);
+
+	// The sections are checked against the size of the file before their
+	// data is allocated, with the same errors as try_read_pe_image.
+	uint64_t file_size;
+	uint64_t o = r.offset;
+	if (!r.size(file_size) || !r.seek(o)) return fail(24);
 
 	pe.sections.resize(n_sections);
 
 	for (auto & section : pe.sections) {
-		char section_name[9] = {};
-		if (fread(section_name, 8, 1, f) != 1) throw 13;
-		section.name = section_name;
+		unsigned char header[SectionHeader::size];
+		size_t n = r.read_some(header, sizeof(header));
+		if (int error = check_section_header(header, n)) return fail(error);
 
-		section.virtual_size    = read_uint32(f, 14);
-		section.virtual_address = read_uint32(f, 15);
+		uint32_t data_size, data_offset;
+		read_section_header(header, section, data_size, data_offset);
 
-		uint32_t data_size   = read_uint32(f, 16);
-		uint32_t data_offset = read_uint32(f, 17);
+		o = r.offset;
 
-		if (read_uint32(f, 18) != 0) throw 29; // reloc_offset
-		if (read_uint32(f, 19) != 0) throw 30; // lineno_offset
-		if (read_uint16(f, 20) != 0) throw 31; // n_reloc
-		if (read_uint16(f, 21) != 0) throw 32; // n_lineno
+		if (data_size > 0 && data_offset > file_size) return fail(24);
+		if (data_size > 0 && data_offset + uint64_t(data_size) > file_size) return fail(25);
+		if (!r.seek(data_offset)) return fail(24);
+		std::vector<unsigned char> data(data_size);
+		if (data.size() > 0) {
+			if (!r.read(data.data(), data.size())) return fail(25);
+		}
+		section.data = std::move(data);
 
-		section.characteristics = read_uint32(f, 22);
+		if (!r.seek(o)) return fail(26);
+	}
 
-		int o = ftell(f);
-		if (o < 0) throw 23;
+	PE_COUNT(entries, pe.sections.size());
 
-		if (fseek(f, data_offset, SEEK_SET) != 0) throw 24;
-		section.data.resize(data_size);
-		if (section.data.size() > 0) {
-			read_data(f, section.data.data(), section.data.size(), 25);
-		}
+	return pe;
+}
 
-		if (fseek(f, o, SEEK_SET) != 0) throw 26;
+PortableExecutable read_pe_file(FILE * f) {
+	return try_read_pe_file(f).value();
+}
+
+// Same checks (and error numbers) as try_read_pe_file, but without copying anything.
+Result<ImageView> try_read_pe_image(mstd::range<unsigned char const> file) {
+	using namespace layout;
+	PE_STAGE(read_pe_image);
+
+	auto data = file;
+	auto fail = [&] (int reason) { return Error{Stage::read_pe_image, reason, file.size() - data.size()}; };
+
+	mstd::range<unsigned char const> skipped;
+	uint16_t mz, n_sections, optheader_size;
+	uint32_t pe_header_offset, signature;
+	if (!take_uint16(data, mz)) return fail(1);
+	if (mz != DosHeader::magic_value) return fail(2);
+	if (file.size() < DosHeader::pe_header_offset::offset) return fail(3);
+	data = file.subrange(DosHeader::pe_header_offset::offset);
+	if (!take_uint32(data, pe_header_offset)) return fail(4);
+	if (file.size() < pe_header_offset) return fail(5);
+	data = file.subrange(pe_header_offset);
+	if (!take_uint32(data, signature)) return fail(6);
+	if (signature != CoffHeader::signature_value) return fail(7);
+	if (!take_data(data, CoffHeader::n_sections::offset - CoffHeader::signature::end, skipped)) return fail(8);
+	if (!take_uint16(data, n_sections)) return fail(9);
+	if (!take_data(data, CoffHeader::optional_header_size::offset - CoffHeader::n_sections::end, skipped)) return fail(10);
+	if (!take_uint16(data, optheader_size)) return fail(11);
+	if (!take_data(data, CoffHeader::size - CoffHeader::optional_header_size::end, skipped)) return fail(12);
+	if (!take_data(data, optheader_size, skipped)) return fail(12);
+
+	ImageView image;
+	image.headers = file.subrange(0, file.size() - data.size());
+
+	image.sections.resize(n_sections);
+
+	for (auto & section : image.sections) {
+		size_t n = std::min(data.size(), SectionHeader::size);
+		if (int error = check_section_header(data.data(), n)) return fail(error);
+
+		uint32_t data_size, data_offset;
+		read_section_header(data.data(), section, data_size, data_offset);
+		data.remove_prefix(SectionHeader::size);
+
+		if (data_size > 0 && file.size() < data_offset) return fail(24);
+		section.data_offset = data_offset;
+		section.data = file.subrange(data_offset, data_size);
+		if (section.data.size() != data_size) return fail(25);
 	}
 
+	PE_COUNT(entries, image.sections.size());
+
+	return image;
+}
+
+ImageView read_pe_image(mstd::range<unsigned char const> file) {
+	return try_read_pe_image(file).value();
+}
+
+PortableExecutable materialize(ImageView const & image) {
+	PortableExecutable pe;
+	pe.headers.assign(image.headers.begin(), image.headers.end());
+	pe.sections.resize(image.sections.size());
+	for (size_t i = 0; i < pe.sections.size(); ++i) {
+		auto const & s = image.sections[i];
+		auto & section = pe.sections[i];
+		section.name            = s.name;
+		section.virtual_size    = s.virtual_size;
+		section.virtual_address = s.virtual_address;
+		section.characteristics = s.characteristics;
+		section.data = std::vector<unsigned char>(s.data.begin(), s.data.end());
+	}
 	return pe;
-} catch (int error) {
-	throw std::runtime_error("Unable to parse PE file. (Error " + std::to_string(error) + ")");
 }
 
-void write_pe_file(FILE * f, PortableExecutable const & pe) try {
-	auto headers = pe.headers;
+namespace {
+
+// Enough zeros for any padding, which is always less than 512 bytes.
+unsigned char const zeros[512] = {};
+
+}
+
+uint32_t checksum_of(std::vector<Chunk> const & chunks) {
+	Checksum checksum;
+	for (auto const & c : chunks) checksum.update({c.data, c.size});
+	return checksum.value();
+}
+
+void set_checksum(WritePlan & plan) {
+	write_uint32(&plan.head[plan.checksum_offset], checksum_of(plan.chunks));
+}
+
+WritePlan plan_pe_file(PortableExecutable const & pe) try {
+	WritePlan plan;
+
+	if (pe.headers.size() < layout::DosHeader::size) throw 500;
+
+	uint32_t pe_header_offset = layout::DosHeader::pe_header_offset::read(pe.headers.data());
 
-	if (headers.size() < 0x40) throw 500;
+	// At least the smaller (PE32) optional header, without data directories.
+	uint64_t optional_header_end = uint64_t(pe_header_offset) + layout::CoffHeader::size + layout::OptionalHeader32::data_directories;
+	if (pe.headers.size() < optional_header_end) throw 501;
 
-	uint32_t pe_header_offset =
-		headers[0x3C] | headers[0x3D] << 8 | headers[0x3E] << 16 | headers[0x3F] << 24;
+	size_t section_table_size = layout::SectionHeader::size * pe.sections.size();
 
-	if (headers.size() < pe_header_offset + 0x70) throw 501;
+	auto & head = plan.head;
+	head.resize(pe.headers.size() + section_table_size);
+	std::copy(pe.headers.begin(), pe.headers.end(), head.begin());
+
+	ImageHeaders headers(pe.headers);
 
 	size_t image_size = 0;
 	for (auto & section : pe.sections) {
 		size_t m = section.virtual_address + section.virtual_size;
 		if (m > image_size) image_size = m;
-		int offset = -1;
-		if (section.name == ".rsrc") {
-			offset = pe_header_offset + 0x88 + 4;
+		if (section.name == ".rsrc" && headers.n_data_directories() > resource_directory) {
+			layout::DataDirectory::size::write(&head[headers.data_directory_offset(resource_directory)], section.virtual_size);
 		} // TODO: other sections.
-		if (offset != -1) {
-			if (headers.size() >= offset + 4) {
-				headers[offset    ] = section.virtual_size       & 0xFF;
-				headers[offset + 1] = section.virtual_size >>  8 & 0xFF;
-				headers[offset + 2] = section.virtual_size >> 16 & 0xFF;
-				headers[offset + 3] = section.virtual_size >> 24 & 0xFF;
-			}
-		}
 	}
 
-	uint32_t alignment =
-		headers[pe_header_offset + 0x38]       |
-		headers[pe_header_offset + 0x39] <<  8 |
-		headers[pe_header_offset + 0x3a] << 16 |
-		headers[pe_header_offset + 0x3b] << 24;
+	uint32_t alignment = headers.section_alignment();
+
+	if (alignment == 0) throw 502;
 
 	image_size = ((image_size + alignment - 1) / alignment) * alignment;
 
-	headers[pe_header_offset + 0x50] = image_size       & 0xFF;
-	headers[pe_header_offset + 0x51] = image_size >>  8 & 0xFF;
-	headers[pe_header_offset + 0x52] = image_size >> 16 & 0xFF;
-	headers[pe_header_offset + 0x53] = image_size >> 24 & 0xFF;
+	write_uint32(&head[headers.size_of_image_offset()], image_size);
 
+	plan.checksum_offset = headers.checksum_offset();
+	write_uint32(&head[plan.checksum_offset], 0);
 
-	write_data(f, headers.data(), headers.size());
+	plan.chunks.reserve(1 + 3 * pe.sections.size());
+	plan.chunks.push_back({head.data(), head.size(), nullptr});
 
-	size_t section_table_size = 40 * pe.sections.size();
+	size_t section_data_offset = head.size();
 
-	size_t first_section_data_offset = pe.headers.size() + section_table_size;
-	size_t section_data_offset = first_section_data_offset;
+	unsigned char * entry = &head[pe.headers.size()];
 
 	for (auto & section : pe.sections) {
-		unsigned char section_name[8] = {};
-		section.name.copy((char *)section_name, 8);
-		write_data(f, section_name, 8);
-		write_uint32(f, section.virtual_size);
-		write_uint32(f, section.virtual_address);
+		size_t p = padding(section_data_offset, 512);
+		section_data_offset += p;
+		if (p) plan.chunks.push_back({zeros, p, nullptr});
+
+		using H = layout::SectionHeader;
 		size_t data_padding = padding(section.data.size(), 512);
-		write_uint32(f, section.data.size() + data_padding);
-		if (section.data.empty()) {
-			write_uint32(f, 0);
-		} else {
-			section_data_offset += padding(section_data_offset, 512);
-			write_uint32(f, section_data_offset);
-			section_data_offset += section.data.size() + data_padding;
+		section.name.copy(reinterpret_cast<char *>(entry + H::name::offset), H::name::size);
+		H::virtual_size::write(entry, section.virtual_size);
+		H::virtual_address::write(entry, section.virtual_address);
+		H::data_size::write(entry, section.data.size() + data_padding);
+		H::data_offset::write(entry, section.data.empty() ? 0 : section_data_offset);
+		// reloc_offset, lineno_offset, n_reloc and n_lineno stay zero.
+		H::characteristics::write(entry, section.characteristics);
+		entry += H::size;
+
+		if (!section.data.empty()) plan.chunks.push_back({section.data.data(), section.data.size(), section.data.source()});
+		if (data_padding) plan.chunks.push_back({zeros, data_padding, nullptr});
+		section_data_offset += section.data.size() + data_padding;
+	}
+
+	plan.size = section_data_offset;
+
+	return plan;
+} catch (int error) {
+	throw std::runtime_error("Unable to write PE file. (Error " + std::to_string(error) + ")");
+}
+
+namespace {
+
+#ifndef WIN32
+void write_vectored(int fd, std::vector<Chunk> const & chunks) {
+	std::vector<iovec> iov(chunks.size());
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		iov[i].iov_base = const_cast<unsigned char *>(chunks[i].data);
+		iov[i].iov_len = chunks[i].size;
+	}
+	size_t i = 0;
+	while (i < iov.size()) {
+		int n = std::min<size_t>(iov.size() - i, IOV_MAX);
+		PE_COUNT(io_calls, 1);
+		ssize_t written = writev(fd, &iov[i], n);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error("Unable to write to file.");
+		}
+		// Skip over everything that has been written, which might end halfway a chunk.
+		size_t w = written;
+		PE_COUNT(bytes_written, w);
+		while (i < iov.size() && w >= iov[i].iov_len) w -= iov[i++].iov_len;
+		if (w) {
+			iov[i].iov_base = static_cast<unsigned char *>(iov[i].iov_base) + w;
+			iov[i].iov_len -= w;
 		}
-		write_uint32(f, 0); // reloc_offset
-		write_uint32(f, 0); // lineno_offset
-		write_uint16(f, 0); // n_reloc
-		write_uint16(f, 0); // n_lineno
-		write_uint32(f, section.characteristics);
 	}
+}
 
-	section_data_offset = first_section_data_offset;
+// Let the kernel copy a chunk straight from the file it was mapped from,
+// without it passing through our memory. Returns the number of bytes copied,
+// which is less than the chunk size if (part of) it has to be written normally.
+size_t copy_from_source(int fd, Chunk const & chunk) {
+#ifdef PE_HAVE_COPY_FILE_RANGE
+	int source_fd = chunk.source->file_descriptor();
+	if (source_fd < 0) return 0;
+	loff_t offset = chunk.data - chunk.source->data().data();
+	size_t copied = 0;
+	while (copied < chunk.size) {
+		PE_COUNT(io_calls, 1);
+		ssize_t n = copy_file_range(source_fd, &offset, fd, nullptr, chunk.size - copied, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		PE_COUNT(bytes_written, n);
+		copied += n;
+	}
+	return copied;
+#else
+	(void)fd;
+	(void)chunk;
+	return 0;
+#endif
+}
 
+// Also passes everything to the checksum and observe, if given.
+void write_chunks(int fd, std::vector<Chunk> const & chunks, Checksum * checksum, WriteObserver const * observe) {
+	std::vector<Chunk> pending;
+	uint64_t offset = 0;
+	for (Chunk c : chunks) {
+		if (checksum) checksum->update({c.data, c.size});
+		if (observe) (*observe)(offset, {c.data, c.size});
+		offset += c.size;
+		if (c.source) {
+			write_vectored(fd, pending);
+			pending.clear();
+			size_t n = copy_from_source(fd, c);
+			c.data += n;
+			c.size -= n;
+		}
+		if (c.size) pending.push_back(c);
+	}
+	write_vectored(fd, pending);
+}
+#endif
+
+}
+
+namespace {
+
+void write_pe_file_(FILE * f, PortableExecutable const & pe, WriteObserver const * observe) {
+	PE_STAGE(write_pe_file);
+	WritePlan plan = plan_pe_file(pe);
+	long start = ftell(f);
+	// Not seekable, so the checksum has to be known before writing.
+	if (start < 0) set_checksum(plan);
+	Checksum checksum;
+	uint64_t offset = 0;
+	for (auto const & c : plan.chunks) {
+		if (start >= 0) checksum.update({c.data, c.size});
+		write_data(f, c.data, c.size);
+		if (observe) (*observe)(offset, {c.data, c.size});
+		offset += c.size;
+	}
+	if (start >= 0) {
+		write_uint32(&plan.head[plan.checksum_offset], checksum.value());
+		if (fseek(f, start + plan.checksum_offset, SEEK_SET) != 0) throw std::runtime_error("Unable to write to file.");
+		write_data(f, &plan.head[plan.checksum_offset], 4);
+		if (fseek(f, start + plan.size, SEEK_SET) != 0) throw std::runtime_error("Unable to write to file.");
+	}
+	if (observe) (*observe)(plan.checksum_offset, {&plan.head[plan.checksum_offset], 4});
+}
+
+}
+
+void write_pe_file(FILE * f, PortableExecutable const & pe, WriteObserver const & observe) {
+	write_pe_file_(f, pe, &observe);
+}
+
+void write_pe_file(FILE * f, PortableExecutable const & pe) {
+	write_pe_file_(f, pe, nullptr);
+}
+
+size_t pe_image_size(PortableExecutable const & pe) {
+	size_t size = pe.headers.size() + layout::SectionHeader::size * pe.sections.size();
 	for (auto & section : pe.sections) {
-		size_t p = padding(section_data_offset, 512);
-		section_data_offset += p;
-		if (p) write_data(f, std::vector<unsigned char>(p).data(), p);
-		if (!section.data.empty()) write_data(f, section.data.data(), section.data.size());
-		p = padding(section.data.size(), 512);
-		if (p) write_data(f, std::vector<unsigned char>(p).data(), p);
-		section_data_offset += section.data.size() + p;
+		size += padding(size, 512);
+		size += section.data.size() + padding(section.data.size(), 512);
 	}
+	return size;
+}
 
-} catch (int error) {
-	throw std::runtime_error("Unable to write PE file. (Error " + std::to_string(error) + ")");
+void write_pe_image(mstd::range<unsigned char> buffer, PortableExecutable const & pe) {
+	PE_STAGE(write_pe_file);
+	WritePlan plan = plan_pe_file(pe);
+	if (buffer.size() < plan.size) throw std::runtime_error("Unable to write PE file. (Buffer too small)");
+	unsigned char * out = buffer.data();
+	Checksum checksum;
+	for (auto const & c : plan.chunks) {
+		checksum.update({c.data, c.size});
+		std::copy(c.data, c.data + c.size, out);
+		out += c.size;
+	}
+	write_uint32(buffer.data() + plan.checksum_offset, checksum.value());
+	PE_COUNT(bytes_written, plan.size);
 }
 
-PortableExecutable read_pe_file(char const * file_name) {
+Result<PortableExecutable> try_read_pe_file(char const * file_name) {
 	FILE * f = fopen(file_name, "rb");
-	if (!f) throw std::runtime_error("Unable to open file.");
-	PortableExecutable pe;
+	if (!f) return Error{Stage::read_pe_file, Error::cannot_open, 0};
 	try {
-		pe = read_pe_file(f);
+		auto result = try_read_pe_file(f);
+		fclose(f);
+		return result;
 	} catch (...) {
 		fclose(f);
 		throw;
 	}
-	fclose(f);
-	return pe;
+}
+
+PortableExecutable read_pe_file(char const * file_name) {
+	return try_read_pe_file(file_name).value();
 }
 
 #ifdef WIN32
-PortableExecutable read_pe_file(wchar_t const * file_name) {
+Result<PortableExecutable> try_read_pe_file(wchar_t const * file_name) {
 	FILE * f = _wfopen(file_name, L"rb");
-	if (!f) throw std::runtime_error("Unable to open file.");
-	PortableExecutable pe;
+	if (!f) return Error{Stage::read_pe_file, Error::cannot_open, 0};
 	try {
-		pe = read_pe_file(f);
+		auto result = try_read_pe_file(f);
+		fclose(f);
+		return result;
 	} catch (...) {
 		fclose(f);
 		throw;
 	}
-	fclose(f);
-	return pe;
+}
+
+PortableExecutable read_pe_file(wchar_t const * file_name) {
+	return try_read_pe_file(file_name).value();
 }
 #endif
 
+#ifdef WIN32
 void write_pe_file(char const * file_name, PortableExecutable const & pe) {
 	FILE * f = fopen(file_name, "wb");
 	if (!f) throw std::runtime_error("Unable to open file.");
@@ -243,6 +561,56 @@ void write_pe_file(char const * file_name, PortableExecutable const & pe) {
 	fclose(f);
 }
 
+void write_pe_file(char const * file_name, PortableExecutable const & pe, WriteObserver const & observe) {
+	FILE * f = fopen(file_name, "wb");
+	if (!f) throw std::runtime_error("Unable to open file.");
+	try {
+		write_pe_file(f, pe, observe);
+	} catch (...) {
+		fclose(f);
+		throw;
+	}
+	fclose(f);
+}
+#else
+namespace {
+
+void write_pe_file_(char const * file_name, PortableExecutable const & pe, WriteObserver const * observe) {
+	PE_STAGE(write_pe_file);
+	WritePlan plan = plan_pe_file(pe);
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) throw std::runtime_error("Unable to open file.");
+	try {
+		if (lseek(fd, 0, SEEK_CUR) < 0) {
+			// Not seekable, so the checksum has to be known before writing.
+			set_checksum(plan);
+			write_chunks(fd, plan.chunks, nullptr, observe);
+		} else {
+			Checksum checksum;
+			write_chunks(fd, plan.chunks, &checksum, observe);
+			write_uint32(&plan.head[plan.checksum_offset], checksum.value());
+			PE_COUNT(io_calls, 1);
+			if (pwrite(fd, &plan.head[plan.checksum_offset], 4, plan.checksum_offset) != 4) throw std::runtime_error("Unable to write to file.");
+		}
+		if (observe) (*observe)(plan.checksum_offset, {&plan.head[plan.checksum_offset], 4});
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	if (close(fd) != 0) throw std::runtime_error("Unable to write to file.");
+}
+
+}
+
+void write_pe_file(char const * file_name, PortableExecutable const & pe) {
+	write_pe_file_(file_name, pe, nullptr);
+}
+
+void write_pe_file(char const * file_name, PortableExecutable const & pe, WriteObserver const & observe) {
+	write_pe_file_(file_name, pe, &observe);
+}
+#endif
+
 #ifdef WIN32
 void write_pe_file(wchar_t const * file_name, PortableExecutable const & pe) {
 	FILE * f = _wfopen(file_name, L"wb");
@@ -2,17 +2,64 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <mstd/range.hpp>
+
+#include "pe-result.hpp"
+
 namespace PE {
 
+class MappedFile;
+
+// The contents of a section.
+//
+// This either owns its bytes, or refers to bytes owned by something else, such
+// as a mapped file. A view is turned into an owned copy only when it's
+// modified through edit(), so sections that are never modified are never
+// copied.
+class SectionData {
+public:
+	SectionData() {}
+	SectionData(std::vector<unsigned char> data) : owned_(std::move(data)) {}
+
+	// Refer to bytes that stay valid for as long as source is alive, or, if
+	// source is null, for as long as this SectionData is used.
+	explicit SectionData(mstd::range<unsigned char const> view, std::shared_ptr<MappedFile const> source = nullptr)
+		: view_(view), source_(std::move(source)), is_view_(true) {}
+
+	unsigned char const * data() const { return is_view_ ? view_.data() : owned_.data(); }
+	size_t size() const { return is_view_ ? view_.size() : owned_.size(); }
+	bool empty() const { return size() == 0; }
+
+	unsigned char const * begin() const { return data(); }
+	unsigned char const * end() const { return data() + size(); }
+	unsigned char operator [] (size_t i) const { return data()[i]; }
+
+	bool is_view() const { return is_view_; }
+
+	// The mapped file this is a view into, if any.
+	MappedFile const * source() const { return source_.get(); }
+
+	// Get the bytes for modification, copying them first if this is a view.
+	std::vector<unsigned char> & edit();
+
+private:
+	std::vector<unsigned char> owned_;
+	mstd::range<unsigned char const> view_;
+	std::shared_ptr<MappedFile const> source_;
+	bool is_view_ = false;
+};
+
 struct Section {
 	std::string name;
 	uint32_t virtual_size;
 	uint32_t virtual_address;
 	uint32_t characteristics;
-	std::vector<unsigned char> data;
+	SectionData data;
 };
 
 struct PortableExecutable {
@@ -20,14 +67,62 @@ struct PortableExecutable {
 	std::vector<Section> sections;
 };
 
+// Non-owning counterparts of Section and PortableExecutable, referring to the
+// bytes of an image that is kept alive elsewhere (e.g. by a MappedImage).
+struct SectionView {
+	std::string name;
+	uint32_t virtual_size;
+	uint32_t virtual_address;
+	uint32_t characteristics;
+	uint32_t data_offset; // File offset of data.
+	mstd::range<unsigned char const> data;
+};
+
+struct ImageView {
+	mstd::range<unsigned char const> headers;
+	std::vector<SectionView> sections;
+};
+
 PortableExecutable read_pe_file(FILE *);
 
+// Parse a PE image that's already in memory. Nothing is copied: the result
+// refers to the given bytes, which must outlive it.
+ImageView read_pe_image(mstd::range<unsigned char const>);
+
+// Like read_pe_file and read_pe_image, but returning an Error instead of
+// throwing when the file isn't a valid PE file, which is much cheaper when
+// many files are expected to be invalid. Nothing is allocated before the
+// headers are found to be valid.
+Result<PortableExecutable> try_read_pe_file(FILE *);
+Result<ImageView> try_read_pe_image(mstd::range<unsigned char const>);
+
+// Copy an ImageView into a PortableExecutable, which owns its data.
+PortableExecutable materialize(ImageView const &);
+
 void write_pe_file(FILE *, PortableExecutable const &);
 
+// The size of the file write_pe_file would write.
+size_t pe_image_size(PortableExecutable const &);
+
+// Like write_pe_file, but into memory. The buffer must be at least
+// pe_image_size() bytes.
+void write_pe_image(mstd::range<unsigned char>, PortableExecutable const &);
+
+// Like write_pe_file, but also pass everything that's written to observe,
+// with its offset in the file, e.g. to compute a digest of the file while
+// writing it. All data is passed once in order, with the CheckSum field
+// zero, unless it had to be computed first. Then the CheckSum field is passed
+// again, with its final value.
+using WriteObserver = std::function<void (uint64_t offset, mstd::range<unsigned char const>)>;
+void write_pe_file(FILE *, PortableExecutable const &, WriteObserver const & observe);
+
 PortableExecutable read_pe_file(char const * file_name);
+Result<PortableExecutable> try_read_pe_file(char const * file_name);
 void write_pe_file(char const * file_name, PortableExecutable const &);
+void write_pe_file(char const * file_name, PortableExecutable const &, WriteObserver const & observe);
 #ifdef WIN32
 PortableExecutable read_pe_file(wchar_t const * file_name);
+Result<PortableExecutable> try_read_pe_file(wchar_t const * file_name);
 void write_pe_file(wchar_t const * file_name, PortableExecutable const &);
 #endif
 